@@ -0,0 +1,175 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+
+// In-tree LZ77 block codec for compressed subscriber streams
+//
+// A block is a list of sequences. Each sequence is a token byte, whose high
+// nibble is the literal count and low nibble the match length minus 4 (15 in
+// either nibble means more length bytes follow, each adding up to 255), then
+// the literals, then a 2 byte little endian offset back into the output. The
+// last sequence has literals only and ends the block.
+
+// Raw size at which the server compresses and sends a client's batch
+const size_t COMPRESS_BLOCK_SIZE = 32768;
+// Shortest match worth encoding
+const size_t LZ_MIN_MATCH = 4;
+// Farthest match offset
+const size_t LZ_MAX_OFFSET = 65535;
+// Hash table of recent positions, 2^LZ_HASH_BITS entries
+const int LZ_HASH_BITS = 12;
+
+// Header in front of every block of a compressed stream
+// packed_length == raw_length means the block is stored uncompressed
+typedef struct CompressedBlockHeader
+{
+    uint32_t raw_length;
+    uint32_t packed_length;
+} CompressedBlockHeader;
+
+// Function to hash the 4 bytes at p
+uint32_t LZHash(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+// Function to write an extended length, returns false if it does not fit
+bool LZWriteLength(uint8_t *dst, size_t cap, size_t &op, size_t len)
+{
+    while (len >= 255)
+    {
+        if (op >= cap)
+            return false;
+        dst[op++] = 255;
+        len -= 255;
+    }
+    if (op >= cap)
+        return false;
+    dst[op++] = (uint8_t)len;
+    return true;
+}
+
+// Function to write one sequence, match_len 0 ends the block, returns false if it does not fit
+bool LZWriteSequence(uint8_t *dst, size_t cap, size_t &op, const uint8_t *literals, size_t lit_len, size_t offset,
+                     size_t match_len)
+{
+    if (op >= cap)
+        return false;
+    size_t token = op++;
+    size_t lit_code = lit_len < 15 ? lit_len : 15;
+    size_t match_code = 0;
+    if (match_len > 0)
+        match_code = match_len - LZ_MIN_MATCH < 15 ? match_len - LZ_MIN_MATCH : 15;
+    dst[token] = (uint8_t)((lit_code << 4) | match_code);
+    if (lit_code == 15 && !LZWriteLength(dst, cap, op, lit_len - 15))
+        return false;
+    if (op + lit_len > cap)
+        return false;
+    memcpy(dst + op, literals, lit_len);
+    op += lit_len;
+    if (match_len == 0)
+        return true;
+    if (op + 2 > cap)
+        return false;
+    dst[op++] = offset & 0xFF;
+    dst[op++] = offset >> 8;
+    if (match_code == 15 && !LZWriteLength(dst, cap, op, match_len - LZ_MIN_MATCH - 15))
+        return false;
+    return true;
+}
+
+// Function to compress n bytes of src into dst, returns the compressed size,
+// or 0 if it does not fit in cap bytes (the caller then stores the block raw)
+size_t LZCompress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap)
+{
+    // Positions are stored plus one, 0 marks an empty entry
+    uint32_t table[1 << LZ_HASH_BITS] = {0};
+    size_t op = 0;
+    size_t anchor = 0;
+    size_t i = 0;
+    while (i + LZ_MIN_MATCH <= n)
+    {
+        uint32_t h = LZHash(src + i);
+        size_t candidate = table[h];
+        table[h] = i + 1;
+        if (candidate > 0 && i - (candidate - 1) <= LZ_MAX_OFFSET && memcmp(src + candidate - 1, src + i, LZ_MIN_MATCH) == 0)
+        {
+            size_t match = candidate - 1;
+            size_t len = LZ_MIN_MATCH;
+            while (i + len < n && src[match + len] == src[i + len])
+                len++;
+            if (!LZWriteSequence(dst, cap, op, src + anchor, i - anchor, i - match, len))
+                return 0;
+            i += len;
+            anchor = i;
+        }
+        else
+        {
+            i++;
+        }
+    }
+    if (!LZWriteSequence(dst, cap, op, src + anchor, n - anchor, 0, 0))
+        return 0;
+    return op;
+}
+
+// Function to read an extended length, returns false past the end of the input
+bool LZReadLength(const uint8_t *src, size_t n, size_t &ip, size_t &len)
+{
+    uint8_t b;
+    do
+    {
+        if (ip >= n)
+            return false;
+        b = src[ip++];
+        len += b;
+    } while (b == 255);
+    return true;
+}
+
+// Function to decompress n bytes of src into exactly raw_len bytes of dst
+// Returns 0 on success, -1 if the block is corrupt
+int LZDecompress(const uint8_t *src, size_t n, uint8_t *dst, size_t raw_len)
+{
+    size_t ip = 0;
+    size_t op = 0;
+    while (ip < n)
+    {
+        uint8_t token = src[ip++];
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && !LZReadLength(src, n, ip, lit_len))
+            return -1;
+        if (ip + lit_len > n || op + lit_len > raw_len)
+            return -1;
+        memcpy(dst + op, src + ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+        // The last sequence has no match
+        if (ip == n)
+            break;
+        if (ip + 2 > n)
+            return -1;
+        size_t offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        size_t match_len = (token & 15) + LZ_MIN_MATCH;
+        if ((token & 15) == 15 && !LZReadLength(src, n, ip, match_len))
+            return -1;
+        if (offset == 0 || offset > op || op + match_len > raw_len)
+            return -1;
+        if (offset >= match_len)
+        {
+            memcpy(dst + op, dst + op - offset, match_len);
+            op += match_len;
+        }
+        else
+        {
+            // Byte by byte, the match overlaps the bytes it produces
+            for (size_t k = 0; k < match_len; k++, op++)
+                dst[op] = dst[op - offset];
+        }
+    }
+    return op == raw_len ? 0 : -1;
+}
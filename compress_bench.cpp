@@ -0,0 +1,188 @@
+#include "helper.h"
+#include <random>
+#include <chrono>
+#include <fstream>
+
+using namespace std;
+
+// Frames generated when no capture file is given
+const int SYNTHETIC_FRAMES = 20000;
+// Block sizes compared, the server uses COMPRESS_BLOCK_SIZE
+const size_t BLOCK_SIZES[] = {4096, 16384, COMPRESS_BLOCK_SIZE, 65536};
+// Minimum time spent measuring each direction, in seconds
+const double MEASURE_SECONDS = 0.5;
+
+// Function to append the frame the server would send for a datagram
+void AppendFrame(vector<uint8_t> &stream, const char *datagram, int len, uint32_t ip, int port)
+{
+    if (len <= MAX_TOPIC_SIZE || len > MAX_DATAGRAM_SIZE)
+        return;
+    int data_size = len - MAX_TOPIC_SIZE;
+    TCP_Header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.ip = ip;
+    hdr.port = port;
+    hdr.length = sizeof(TCP_Header) + data_size;
+    hdr.data_type = datagram[MAX_TOPIC_SIZE - 1];
+    strncpy(hdr.topic, datagram, MAX_TOPIC_SIZE - 1);
+    stream.insert(stream.end(), (uint8_t *)&hdr, (uint8_t *)&hdr + sizeof(hdr));
+    stream.insert(stream.end(), datagram + MAX_TOPIC_SIZE, datagram + len);
+}
+
+// Function to load the frames of a capture file
+int LoadCapture(const char *path, vector<uint8_t> &stream, int &frames)
+{
+    ifstream in(path, ios::binary);
+    CaptureFileHeader hdr;
+    if (!in.read((char *)&hdr, sizeof(hdr)) || memcmp(hdr.magic, CAPTURE_MAGIC, sizeof(hdr.magic)) != 0)
+    {
+        cerr << "Invalid capture file " << path << endl;
+        return -1;
+    }
+    CaptureRecord rec;
+    char datagram[MAX_DATAGRAM_SIZE];
+    while (in.read((char *)&rec, sizeof(rec)) && rec.length <= MAX_DATAGRAM_SIZE && in.read(datagram, rec.length))
+    {
+        AppendFrame(stream, datagram, rec.length, rec.ip, rec.port);
+        frames++;
+    }
+    return 0;
+}
+
+// Function to generate frames like a fleet of sensors publishing on a few hundred topics
+void GenerateFrames(vector<uint8_t> &stream, int &frames)
+{
+    const char *buildings[] = {"precis", "ec", "ed", "prec", "aula"};
+    const char *metrics[] = {"temperature", "humidity", "pressure", "people", "floor"};
+    const char *days[] = {"monday", "tuesday", "wednesday", "thursday", "friday"};
+    const char *courses[] = {"Protocoale De Comunicatie", "Programarea Calculatoarelor", "Sisteme de Operare",
+                             "Analiza Algoritmilor", "Proiectarea Algoritmilor"};
+    mt19937 rng(1);
+    char datagram[MAX_DATAGRAM_SIZE];
+    for (frames = 0; frames < SYNTHETIC_FRAMES; frames++)
+    {
+        memset(datagram, 0, sizeof(datagram));
+        string topic = string("upb/") + buildings[rng() % 5] + "/" + to_string(100 + rng() % 20) + "/";
+        int len = MAX_TOPIC_SIZE;
+        if (rng() % 2 == 0)
+        {
+            // STRING schedule entries
+            topic += string("schedule/") + days[rng() % 5] + "/" + to_string(8 + rng() % 12);
+            datagram[MAX_TOPIC_SIZE - 1] = 3;
+            string text = string(courses[rng() % 5]) + " - sala " + to_string(rng() % 400);
+            memcpy(datagram + len, text.c_str(), text.size());
+            len += text.size();
+        }
+        else
+        {
+            // INT readings
+            topic += metrics[rng() % 5];
+            datagram[MAX_TOPIC_SIZE - 1] = 0;
+            uint32_t value = htonl(rng() % 5000);
+            datagram[len] = rng() % 2;
+            memcpy(datagram + len + 1, &value, sizeof(value));
+            len += 1 + sizeof(value);
+        }
+        memcpy(datagram, topic.c_str(), topic.size());
+        AppendFrame(stream, datagram, len, inet_addr("127.0.0.1"), 40000 + rng() % 4);
+    }
+}
+
+// Function to split a frame stream into blocks the way the server batches them
+vector<pair<size_t, size_t>> SplitBlocks(const vector<uint8_t> &stream, size_t block_size)
+{
+    vector<pair<size_t, size_t>> blocks;
+    size_t start = 0;
+    size_t pos = 0;
+    while (pos < stream.size())
+    {
+        TCP_Header hdr;
+        memcpy(&hdr, stream.data() + pos, sizeof(hdr));
+        pos += hdr.length;
+        if (pos - start >= block_size || pos >= stream.size())
+        {
+            blocks.push_back({start, pos - start});
+            start = pos;
+        }
+    }
+    return blocks;
+}
+
+int main(int argc, char *argv[])
+{
+    // Usage: compress_bench [capture_file]
+    vector<uint8_t> stream;
+    int frames = 0;
+    if (argc > 1)
+    {
+        if (LoadCapture(argv[1], stream, frames) < 0)
+            return 1;
+    }
+    else
+    {
+        GenerateFrames(stream, frames);
+    }
+    if (stream.empty())
+    {
+        cerr << "No frames to compress" << endl;
+        return 1;
+    }
+    cout << frames << " frames, " << stream.size() << " bytes, " << (argc > 1 ? argv[1] : "synthetic") << endl;
+    cout << setw(8) << "block" << setw(10) << "ratio" << setw(14) << "saved B/frame" << setw(14) << "comp MB/s"
+         << setw(14) << "comp ns/frame" << setw(14) << "decomp MB/s" << endl;
+
+    vector<uint8_t> packed(COMPRESS_BLOCK_MAX + 65536);
+    vector<uint8_t> raw(COMPRESS_BLOCK_MAX + 65536);
+    for (size_t block_size : BLOCK_SIZES)
+    {
+        vector<pair<size_t, size_t>> blocks = SplitBlocks(stream, block_size);
+
+        // Compress every block, over and over for a stable time
+        size_t wire = 0;
+        long rounds = 0;
+        auto start = chrono::steady_clock::now();
+        double comp_seconds = 0;
+        while (comp_seconds < MEASURE_SECONDS)
+        {
+            wire = 0;
+            for (const auto &b : blocks)
+            {
+                size_t n = LZCompress(stream.data() + b.first, b.second, packed.data(), b.second - 1);
+                wire += sizeof(CompressedBlockHeader) + (n ? n : b.second);
+            }
+            rounds++;
+            comp_seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        }
+        double comp_rate = stream.size() * rounds / comp_seconds / 1e6;
+        double comp_ns_frame = comp_seconds * 1e9 / (rounds * frames);
+
+        // Decompress every block and check it round trips
+        long decomp_rounds = 0;
+        start = chrono::steady_clock::now();
+        double decomp_seconds = 0;
+        while (decomp_seconds < MEASURE_SECONDS)
+        {
+            for (const auto &b : blocks)
+            {
+                size_t n = LZCompress(stream.data() + b.first, b.second, packed.data(), b.second - 1);
+                if (n == 0)
+                    continue;
+                auto t0 = chrono::steady_clock::now();
+                int res = LZDecompress(packed.data(), n, raw.data(), b.second);
+                decomp_seconds += chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+                if (res < 0 || memcmp(raw.data(), stream.data() + b.first, b.second) != 0)
+                {
+                    cerr << "Round trip failed for a block of " << b.second << " bytes" << endl;
+                    return 1;
+                }
+            }
+            decomp_rounds++;
+        }
+        double decomp_rate = stream.size() * decomp_rounds / decomp_seconds / 1e6;
+
+        cout << setw(8) << block_size << fixed << setprecision(3) << setw(10) << (double)wire / stream.size()
+             << setprecision(1) << setw(14) << (double)(stream.size() - wire) / frames << setw(14) << comp_rate
+             << setw(14) << comp_ns_frame << setw(14) << decomp_rate << endl;
+    }
+    return 0;
+}
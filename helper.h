@@ -12,6 +12,13 @@
 #include <netinet/tcp.h>
 #include <iomanip>
 #include <cmath>
+#include <cerrno>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <getopt.h>
+#include <ctime>
+#include "compress.h"
 
 using namespace std;
 
@@ -19,6 +26,10 @@ const int LISTEN_QUEUE_SIZE = 5;
 const int MAX_ID_SIZE = 50;
 const int MAX_TOPIC_SIZE = 51;
 const int MAX_STRING_SIZE = 1501;
+// Largest UDP datagram accepted: topic, data type and payload
+const int MAX_DATAGRAM_SIZE = MAX_TOPIC_SIZE + MAX_STRING_SIZE;
+// SO_BUSY_POLL budget used in low-latency mode, in microseconds
+const int BUSY_POLL_USEC = 50;
 
 // UDP Message
 struct UDPMessage
@@ -29,6 +40,13 @@ struct UDPMessage
     int size;
 };
 
+// Commands of SubscribeMessage
+const uint8_t CMD_UNSUBSCRIBE = 0;
+const uint8_t CMD_SUBSCRIBE = 1;
+const uint8_t CMD_COMPRESS = 2;         // Ask for a compressed stream, topic is unused
+const uint8_t CMD_BULK_SUBSCRIBE = 3;   // A BulkSubscribeHeader and a topic list follow, topic is unused
+const uint8_t CMD_BULK_UNSUBSCRIBE = 4; // Same as CMD_BULK_SUBSCRIBE, removing the topics
+
 // Message for subscribe/unsubscribe
 typedef struct SubscribeMessage
 {
@@ -36,6 +54,16 @@ typedef struct SubscribeMessage
     char topic[MAX_TOPIC_SIZE];
 } SubscribeMessage;
 
+// Largest topic list of one bulk command, longer lists are sent as several commands
+const uint32_t MAX_BULK_SIZE = 65536;
+
+// Follows a bulk SubscribeMessage, then length bytes of count NUL terminated topics
+typedef struct BulkSubscribeHeader
+{
+    uint32_t count;
+    uint32_t length;
+} BulkSubscribeHeader;
+
 // TCP Header
 typedef struct TCP_Header
 {
@@ -46,6 +74,24 @@ typedef struct TCP_Header
     char topic[MAX_TOPIC_SIZE];
 } TCP_Header;
 
+// Highest data_type a publisher may send: 0 INT, 1 SHORT_REAL, 2 FLOAT, 3 STRING
+// The server drops other datagrams, the bits above are only set by the server
+const uint8_t MAX_DATA_TYPE = 3;
+
+// TCP_Header data_type of the frame acknowledging CMD_COMPRESS, every byte after it is
+// a CompressedBlockHeader followed by a block
+const uint8_t STREAM_COMPRESSED = 0x40;
+
+// Set in TCP_Header data_type when a TraceExtension follows the header
+const uint8_t TRACE_FLAG = 0x80;
+
+// Optional header extension for sampled latency tracing, counted in length
+typedef struct TraceExtension
+{
+    uint64_t rx_ns; // Server UDP receive time, kernel timestamp when available
+    uint64_t tx_ns; // Server send time to this subscriber
+} TraceExtension;
+
 // TCP Package
 typedef struct TCP_Package
 {
@@ -53,6 +99,50 @@ typedef struct TCP_Package
     char data[1];
 } TCP_Package;
 
+// Largest packet sent to a subscriber: header, trace extension and payload
+const size_t MAX_PACKET_SIZE = sizeof(TCP_Header) + sizeof(TraceExtension) + MAX_STRING_SIZE;
+
+// Largest raw block of a compressed stream, a full batch plus the packet that overflowed it
+const size_t COMPRESS_BLOCK_MAX = COMPRESS_BLOCK_SIZE + MAX_PACKET_SIZE;
+
+// Capture file header, written once at the start of the file
+const char CAPTURE_MAGIC[8] = "PCOMCAP";
+const uint32_t CAPTURE_VERSION = 1;
+typedef struct CaptureFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+} CaptureFileHeader;
+
+// One captured datagram, followed by length bytes of datagram
+typedef struct CaptureRecord
+{
+    uint64_t ts_ns; // Server receive time
+    uint32_t ip;    // Source address, network order
+    uint16_t port;  // Source port, host order
+    uint16_t length;
+} CaptureRecord;
+
+// Subscription snapshot header, followed by client_count client records
+const char SNAPSHOT_MAGIC[8] = "PCOMSNP";
+const uint32_t SNAPSHOT_VERSION = 1;
+typedef struct SnapshotHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t client_count;
+    uint64_t size; // Whole file, header included
+} SnapshotHeader;
+
+// One client of a snapshot, followed by id_length bytes of id, then
+// topic_count topics, each a length byte and the topic
+typedef struct SnapshotClient
+{
+    uint32_t id_length;
+    uint32_t topic_count;
+} SnapshotClient;
+
 // Class that contains Client Info
 struct ClientInfo
 {
@@ -60,17 +150,104 @@ struct ClientInfo
     bool is_connected;
     string client_id;
     set<string> topics;
+    bool compress;      // Frames are batched and sent as compressed blocks
+    vector<char> batch; // Frames waiting to be compressed
+    // Topics of a client loaded from a snapshot, still in the mapped file until it reconnects
+    const char *saved_topics; // NULL once they are in topics
+    uint32_t saved_count;
+    size_t saved_size;
 };
 
+// Function to check if a topic matches a pattern
+bool TopicMatches(const string &pattern, const string &topic)
+{
+    // Take the pattern and convert it to a regex pattern
+    string regex_pattern = "^" + pattern + "$";
+    // Replace + with [^/]+ to match any character except '/'
+    regex_pattern = regex_replace(regex_pattern, regex("\\+"), "[^/]+");
+    // Replace * with .*
+    regex_pattern = regex_replace(regex_pattern, regex("\\*"), ".*");
+    // Now use regex_match to check if the topic matches the regex pattern
+    return regex_match(topic, regex(regex_pattern));
+}
+
+// Function to find topic, returns true if found
+bool FindTopic(const set<string> &topics, const string &topic)
+{
+    for (const auto &t : topics)
+    {
+        if (TopicMatches(t, topic))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Function to check if a topic matches a pattern without regex, same semantics as
+// TopicMatches for topics made of literal characters, '/', '+' and '*'
+// Tracks the set of reachable topic positions as a bitmask, one pattern char at a time
+bool TopicMatchesFast(const string &pattern, const string &topic)
+{
+    size_t n = topic.size();
+    // Positions 0..n must fit in the mask
+    if (n >= 63)
+    {
+        return TopicMatches(pattern, topic);
+    }
+    uint64_t all = (1ULL << (n + 1)) - 1;
+    uint64_t cur = 1;
+    for (char c : pattern)
+    {
+        uint64_t next = 0;
+        if (c == '*')
+        {
+            // Any suffix starting from the first reachable position
+            next = all & ~((cur & -cur) - 1);
+        }
+        else if (c == '+')
+        {
+            // One or more characters of the current level
+            bool open = false;
+            for (size_t j = 1; j <= n; j++)
+            {
+                open = (open || ((cur >> (j - 1)) & 1)) && topic[j - 1] != '/';
+                if (open)
+                    next |= 1ULL << j;
+            }
+        }
+        else
+        {
+            // Only visit reachable positions, usually just one
+            for (uint64_t bits = cur; bits != 0; bits &= bits - 1)
+            {
+                int i = __builtin_ctzll(bits);
+                if ((size_t)i < n && topic[i] == c)
+                    next |= 1ULL << (i + 1);
+            }
+        }
+        cur = next;
+        if (cur == 0)
+        {
+            return false;
+        }
+    }
+    return (cur >> n) & 1;
+}
+
 // Function to send all data
 ssize_t send_all(int sockfd, const void *buf, size_t len)
 {
     size_t total = 0;
     while (total < len)
     {
-        int bytes_sent = send(sockfd, (const char *)buf + total, len - total, 0);
+        // A peer gone while a backlog is being sent is an error, not a SIGPIPE
+        int bytes_sent = send(sockfd, (const char *)buf + total, len - total, MSG_NOSIGNAL);
         if (bytes_sent == -1)
         {
+            // Non-blocking socket in low-latency mode, spin until it drains
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                continue;
             cerr << "Error sending data" << endl;
             return -1;
         }
@@ -88,6 +265,9 @@ ssize_t receive_all(int sockfd, void *buf, size_t len)
         int bytes_received = recv(sockfd, (char *)buf + total, len - total, 0);
         if (bytes_received == -1)
         {
+            // Non-blocking socket in low-latency mode, spin until data arrives
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                continue;
             cerr << "Error receiving data" << endl;
             return -1;
         }
@@ -99,3 +279,94 @@ ssize_t receive_all(int sockfd, void *buf, size_t len)
     }
     return total;
 }
+
+// Function to get the wall clock time in nanoseconds, same clock as SO_TIMESTAMPNS
+uint64_t NowNs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Function to write a whole buffer to a file
+ssize_t write_all(int fd, const void *buf, size_t len)
+{
+    size_t total = 0;
+    while (total < len)
+    {
+        ssize_t bytes_written = write(fd, (const char *)buf + total, len - total);
+        if (bytes_written == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        total += bytes_written;
+    }
+    return total;
+}
+
+// Function to pin the calling thread to a CPU core
+int PinToCore(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0)
+    {
+        cerr << "Error pinning thread to CPU " << cpu << endl;
+        return -1;
+    }
+    return 0;
+}
+
+// Function to set a socket to non-blocking mode
+int SetNonBlocking(int sockfd)
+{
+    int flags = fcntl(sockfd, F_GETFL, 0);
+    if (flags < 0 || fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+        cerr << "Error setting socket to non-blocking" << endl;
+        return -1;
+    }
+    return 0;
+}
+
+// Function to enable kernel busy polling on a socket
+int SetBusyPoll(int sockfd, int usec)
+{
+    if (setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, (char *)&usec, sizeof(usec)) < 0)
+    {
+        // Needs CAP_NET_ADMIN above net.core.busy_poll, the mode still works without it
+        cerr << "Warning: SO_BUSY_POLL not available" << endl;
+        return -1;
+    }
+    return 0;
+}
+
+// Function to allocate a buffer, optionally faulting and locking its pages up front
+void *AllocBuffer(size_t size, bool prefault)
+{
+    void *buf = malloc(size);
+    if (!buf)
+    {
+        cerr << "Memory allocation failed!" << endl;
+        return NULL;
+    }
+    if (prefault)
+    {
+        // Touch every page so the hot path never takes a page fault
+        memset(buf, 0, size);
+        // Best effort, fails without CAP_IPC_LOCK or enough RLIMIT_MEMLOCK
+        mlock(buf, size);
+    }
+    return buf;
+}
+
+// Function to release a buffer from AllocBuffer
+void FreeBuffer(void *buf, size_t size, bool prefault)
+{
+    if (prefault)
+        munlock(buf, size);
+    free(buf);
+}
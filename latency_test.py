@@ -0,0 +1,74 @@
+import argparse
+import socket
+import time
+
+from subprocess import Popen, PIPE, DEVNULL
+from time import sleep
+
+# default IP for the server
+ip = "127.0.0.1"
+
+# topic used for the probe messages
+probe_topic = "latency/probe"
+
+def build_datagram(payload):
+  """Builds a STRING datagram for the probe topic."""
+  return probe_topic.encode().ljust(50, b"\0") + bytes([3]) + payload
+
+def percentile(values, p):
+  """Returns the p-th percentile of a sorted list, in microseconds."""
+  return values[min(len(values) - 1, int(p * len(values)))] / 1000
+
+def run(args):
+  """Sends probe messages one at a time and measures UDP send to subscriber output."""
+  server_cmd = ["./server", args.port]
+  subscriber_cmd = ["./subscriber", "LAT", ip, args.port]
+  if args.server_cpu is not None:
+    server_cmd += ["--low-latency", str(args.server_cpu)]
+  if args.subscriber_cpu is not None:
+    subscriber_cmd += ["--low-latency", str(args.subscriber_cpu)]
+
+  server = Popen(server_cmd, universal_newlines=True, stdin=PIPE, stdout=PIPE, stderr=DEVNULL)
+  sleep(0.5)
+  subscriber = Popen(subscriber_cmd, universal_newlines=True, stdin=PIPE, stdout=PIPE, stderr=DEVNULL, bufsize=1)
+  server.stdout.readline()
+  subscriber.stdin.write("subscribe " + probe_topic + "\n")
+  subscriber.stdin.flush()
+  subscriber.stdout.readline()
+  # the subscriber confirms before the server applies the subscription
+  sleep(0.5)
+
+  sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+  datagram = build_datagram(b"x" * args.size)
+  samples = []
+  for i in range(args.warmup + args.count):
+    start = time.perf_counter_ns()
+    sock.sendto(datagram, (ip, int(args.port)))
+    subscriber.stdout.readline()
+    if i >= args.warmup:
+      samples.append(time.perf_counter_ns() - start)
+
+  subscriber.stdin.write("exit\n")
+  subscriber.stdin.flush()
+  sleep(0.5)
+  server.stdin.write("exit\n")
+  server.stdin.flush()
+  server.wait(timeout=2)
+
+  samples.sort()
+  print("p50 %.1fus p99 %.1fus p999 %.1fus max %.1fus (%d samples)" % (
+    percentile(samples, 0.5), percentile(samples, 0.99), percentile(samples, 0.999),
+    samples[-1] / 1000, len(samples)))
+
+def main():
+  parser = argparse.ArgumentParser(description="Round trip latency of one UDP message through server and subscriber")
+  parser.add_argument("--port", default="12346", help="server port (default: 12346)")
+  parser.add_argument("--count", type=int, default=20000, help="number of measured messages (default: 20000)")
+  parser.add_argument("--warmup", type=int, default=1000, help="number of unmeasured messages (default: 1000)")
+  parser.add_argument("--size", type=int, default=32, help="payload size in bytes (default: 32)")
+  parser.add_argument("--server-cpu", type=int, help="run the server in low-latency mode pinned to this CPU")
+  parser.add_argument("--subscriber-cpu", type=int, help="run the subscriber in low-latency mode pinned to this CPU")
+  run(parser.parse_args())
+
+if __name__ == "__main__":
+  main()
@@ -0,0 +1,280 @@
+#include "helper.h"
+#include <sys/stat.h>
+#include <algorithm>
+
+using namespace std;
+
+// Datagrams sent with one sendmmsg call
+const int REPLAY_BATCH = 64;
+// Waits shorter than this are spun instead of slept, in nanoseconds
+const uint64_t SPIN_THRESHOLD_NS = 50000;
+// Longest wait between two records when --max-gap is not given, in seconds
+const double DEFAULT_MAX_GAP = 1.0;
+
+// Replay command line options
+struct ReplayOptions
+{
+    const char *path;
+    const char *server_ip;
+    int port;
+    double speed;   // 0 sends as fast as possible
+    double max_gap; // Longest wait between two records in capture time, in seconds
+    int loops;
+};
+
+// Function to get the monotonic time in nanoseconds
+uint64_t MonotonicNs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Function to wait until a monotonic deadline, sleeping first and spinning at the end
+void WaitUntil(uint64_t deadline_ns)
+{
+    uint64_t now = MonotonicNs();
+    if (deadline_ns > now + SPIN_THRESHOLD_NS)
+    {
+        uint64_t sleep_until = deadline_ns - SPIN_THRESHOLD_NS;
+        timespec ts = {(time_t)(sleep_until / 1000000000ULL), (long)(sleep_until % 1000000000ULL)};
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    }
+    while (MonotonicNs() < deadline_ns)
+    {
+    }
+}
+
+// Function to print usage
+void PrintUsage(const char *name)
+{
+    cerr << "Usage: " << name << " <capture_file> <server_ip> <port> [--speed <N> | --max] [--loop <count>]"
+         << " [--max-gap <seconds>]" << endl;
+}
+
+// Function to parse command line options, returns -1 on invalid arguments
+int ParseReplayOptions(int argc, char *argv[], ReplayOptions &options)
+{
+    static const option long_options[] = {
+        {"speed", required_argument, NULL, 's'},
+        {"max", no_argument, NULL, 'm'},
+        {"loop", required_argument, NULL, 'n'},
+        {"max-gap", required_argument, NULL, 'g'},
+        {NULL, 0, NULL, 0}};
+
+    options.speed = 1.0;
+    options.max_gap = DEFAULT_MAX_GAP;
+    options.loops = 1;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "s:mn:g:", long_options, NULL)) != -1)
+    {
+        if (opt == 's' && atof(optarg) > 0)
+        {
+            options.speed = atof(optarg);
+        }
+        else if (opt == 'm')
+        {
+            options.speed = 0;
+        }
+        else if (opt == 'n' && atoi(optarg) > 0)
+        {
+            options.loops = atoi(optarg);
+        }
+        else if (opt == 'g' && atof(optarg) > 0)
+        {
+            options.max_gap = atof(optarg);
+        }
+        else
+        {
+            return -1;
+        }
+    }
+    // Exactly three positional arguments, file, server ip and port
+    if (optind != argc - 3)
+    {
+        return -1;
+    }
+    options.path = argv[optind];
+    options.server_ip = argv[optind + 1];
+    options.port = atoi(argv[optind + 2]);
+    return 0;
+}
+
+// Function to map a capture file, returns NULL if it is not a valid capture
+const char *MapCapture(const char *path, size_t &size)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        cerr << "Error opening capture file " << path << endl;
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(CaptureFileHeader))
+    {
+        cerr << "Invalid capture file " << path << endl;
+        close(fd);
+        return NULL;
+    }
+    size = st.st_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        cerr << "Error mapping capture file " << path << endl;
+        return NULL;
+    }
+    const CaptureFileHeader *hdr = (const CaptureFileHeader *)map;
+    if (memcmp(hdr->magic, CAPTURE_MAGIC, sizeof(hdr->magic)) != 0 || hdr->version != CAPTURE_VERSION)
+    {
+        cerr << "Invalid capture file " << path << endl;
+        munmap(map, size);
+        return NULL;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+    return (const char *)map;
+}
+
+// Function to index the records of a mapped capture file
+vector<const CaptureRecord *> IndexRecords(const char *map, size_t size)
+{
+    vector<const CaptureRecord *> records;
+    size_t offset = sizeof(CaptureFileHeader);
+    while (offset + sizeof(CaptureRecord) <= size)
+    {
+        const CaptureRecord *rec = (const CaptureRecord *)(map + offset);
+        // A truncated last record means the server stopped while writing it
+        if (offset + sizeof(CaptureRecord) + rec->length > size)
+        {
+            cerr << "Ignoring truncated record at offset " << offset << endl;
+            break;
+        }
+        records.push_back(rec);
+        offset += sizeof(CaptureRecord) + rec->length;
+    }
+    return records;
+}
+
+// Function to compute the send time of every record, relative to the first one
+// Timestamps are wall clock times, so a record older than the one before it is sent right
+// after it, and a gap longer than max_gap_ns, like the downtime between two appended
+// captures, is shortened to max_gap_ns
+vector<uint64_t> ReplayOffsets(const vector<const CaptureRecord *> &records, uint64_t max_gap_ns)
+{
+    vector<uint64_t> offsets(records.size());
+    for (size_t i = 1; i < records.size(); i++)
+    {
+        uint64_t prev = records[i - 1]->ts_ns;
+        uint64_t cur = records[i]->ts_ns;
+        uint64_t gap = cur > prev ? min(cur - prev, max_gap_ns) : 0;
+        offsets[i] = offsets[i - 1] + gap;
+    }
+    return offsets;
+}
+
+int main(int argc, char *argv[])
+{
+    ReplayOptions options;
+    if (ParseReplayOptions(argc, argv, options) < 0)
+    {
+        PrintUsage(argv[0]);
+        return 1;
+    }
+
+    size_t size = 0;
+    const char *map = MapCapture(options.path, size);
+    if (!map)
+    {
+        return 1;
+    }
+    vector<const CaptureRecord *> records = IndexRecords(map, size);
+    if (records.empty())
+    {
+        cerr << "No records in " << options.path << endl;
+        munmap((void *)map, size);
+        return 1;
+    }
+
+    // Set up the UDP socket and server address
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0)
+    {
+        cerr << "Error creating socket" << endl;
+        return 1;
+    }
+    sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(options.port);
+    if (inet_pton(AF_INET, options.server_ip, &server_addr.sin_addr) <= 0)
+    {
+        cerr << "Invalid server IP" << endl;
+        return 1;
+    }
+
+    // Messages of one batch, pointing straight into the mapped file
+    mmsghdr msgs[REPLAY_BATCH];
+    iovec iovs[REPLAY_BATCH];
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < REPLAY_BATCH; i++)
+    {
+        msgs[i].msg_hdr.msg_name = &server_addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(server_addr);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    vector<uint64_t> offsets = ReplayOffsets(records, (uint64_t)(options.max_gap * 1e9));
+    uint64_t duration = offsets.back();
+    uint64_t sent = 0;
+    uint64_t bytes = 0;
+    uint64_t start = MonotonicNs();
+    for (int loop = 0; loop < options.loops; loop++)
+    {
+        // Each loop starts where the previous one ended in capture time
+        uint64_t loop_start = options.speed > 0 ? start + (uint64_t)(loop * duration / options.speed) : start;
+        size_t i = 0;
+        while (i < records.size())
+        {
+            // Wait for the next record, then send it with every record already due
+            if (options.speed > 0)
+            {
+                WaitUntil(loop_start + (uint64_t)(offsets[i] / options.speed));
+            }
+            uint64_t now = MonotonicNs();
+            int batch = 0;
+            while (i < records.size() && batch < REPLAY_BATCH)
+            {
+                if (options.speed > 0 && loop_start + (uint64_t)(offsets[i] / options.speed) > now)
+                    break;
+                iovs[batch].iov_base = (void *)(records[i] + 1);
+                iovs[batch].iov_len = records[i]->length;
+                bytes += records[i]->length;
+                batch++;
+                i++;
+            }
+            int done = 0;
+            while (done < batch)
+            {
+                int ret = sendmmsg(sock, msgs + done, batch - done, 0);
+                if (ret < 0)
+                {
+                    cerr << "Error sending datagrams" << endl;
+                    close(sock);
+                    munmap((void *)map, size);
+                    return 1;
+                }
+                done += ret;
+            }
+            sent += batch;
+        }
+    }
+    double elapsed = (MonotonicNs() - start) / 1e9;
+
+    cout << "Replayed " << sent << " datagrams, " << bytes << " bytes in " << fixed << setprecision(3) << elapsed
+         << " s (" << setprecision(0) << sent / elapsed << " datagrams/s, capture spans " << setprecision(3)
+         << duration / 1e9 << " s)" << endl;
+    close(sock);
+    munmap((void *)map, size);
+    return 0;
+}
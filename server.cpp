@@ -1,87 +1,118 @@
 #include "helper.h"
+#include <sys/stat.h>
+#include <algorithm>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include <sys/wait.h>
 
 using namespace std;
 
-// Function to parse UDP message
+// Function to parse UDP message, data points into the receive buffer
 UDPMessage ParseUDPMessage(const char *buffer, int len)
 {
-    UDPMessage msg;
+    UDPMessage msg = {0, "", NULL, 0};
     if (len > MAX_TOPIC_SIZE)
     {
         msg.topic = string(buffer, strnlen(buffer, MAX_TOPIC_SIZE - 1));
         msg.data_type = buffer[MAX_TOPIC_SIZE - 1];
-        msg.data = (uint8_t *)memcpy(new uint8_t[len - MAX_TOPIC_SIZE], buffer + MAX_TOPIC_SIZE, len - MAX_TOPIC_SIZE);
+        msg.data = (uint8_t *)buffer + MAX_TOPIC_SIZE;
         msg.size = len - MAX_TOPIC_SIZE;
     }
     return msg;
 }
 
-// Function to check if a topic matches a pattern
-bool TopicMatches(const string &pattern, const string &topic)
+// Function to remove newline character from a string
+char *RemoveNewLine(char *str)
 {
-    // Take the pattern and convert it to a regex pattern
-    string regex_pattern = "^" + pattern + "$";
-    // Replace + with [^/]+ to match any character except '/'
-    regex_pattern = regex_replace(regex_pattern, regex("\\+"), "[^/]+");
-    // Replace * with .*
-    regex_pattern = regex_replace(regex_pattern, regex("\\*"), ".*");
-    // Now use regex_match to check if the topic matches the regex pattern
-    return regex_match(topic, regex(regex_pattern));
+    int len = strlen(str);
+    if (str[len - 1] == '\n')
+        str[len - 1] = '\0';
+    return str;
 }
 
-// Function to find topic, returns true if found
-bool FindTopic(const set<string> &topics, const string &topic)
+// Function to compress a client's batch into block and send it
+// block holds a CompressedBlockHeader and COMPRESS_BLOCK_MAX bytes
+void FlushBatch(ClientInfo &client, uint8_t *block)
 {
-    for (const auto &t : topics)
+    if (client.batch.empty())
     {
-        if (TopicMatches(t, topic))
-        {
-            return true;
-        }
+        return;
     }
-    return false;
+    CompressedBlockHeader bh;
+    bh.raw_length = client.batch.size();
+    uint8_t *payload = block + sizeof(bh);
+    // Store the block raw if compressing does not make it smaller
+    bh.packed_length = LZCompress((uint8_t *)client.batch.data(), bh.raw_length, payload, bh.raw_length - 1);
+    if (bh.packed_length == 0)
+    {
+        memcpy(payload, client.batch.data(), bh.raw_length);
+        bh.packed_length = bh.raw_length;
+    }
+    memcpy(block, &bh, sizeof(bh));
+    if (send_all(client.sockfd, block, sizeof(bh) + bh.packed_length) < 0)
+    {
+        cerr << "Error sending message to client " << client.client_id << endl;
+    }
+    client.batch.clear();
 }
 
-// Function to remove newline character from a string
-char *RemoveNewLine(char *str)
+// Function to flush the batches of all compressed clients
+void FlushBatches(vector<ClientInfo> &clients, uint8_t *block)
 {
-    int len = strlen(str);
-    if (str[len - 1] == '\n')
-        str[len - 1] = '\0';
-    return str;
+    for (auto &client : clients)
+    {
+        if (client.compress && client.is_connected)
+            FlushBatch(client, block);
+    }
 }
 
-// Function to send UDP message to subscribers
-void SendToSubscribers(const UDPMessage &msg, const vector<ClientInfo> &clients, char *ip, int port)
+// Function to send UDP message to subscribers, p is a preallocated packet buffer
+// If rx_ns is not 0 the packet carries a TraceExtension stamped for each subscriber
+// Compressed clients get the packet appended to their batch, block is the buffer used to flush it
+void SendToSubscribers(const UDPMessage &msg, vector<ClientInfo> &clients, char *ip, int port, TCP_Package *p, uint64_t rx_ns,
+                       uint8_t *block)
 {
+    // Compute the total size for the packet
+    size_t ext_size = rx_ns ? sizeof(TraceExtension) : 0;
+    size_t packet_size = sizeof(TCP_Header) + ext_size + msg.size;
+    bool packet_ready = false;
     // For each client
-    for (const auto &client : clients)
+    for (auto &client : clients)
     {
         // Check if the client is subscribed to the topic
         if (FindTopic(client.topics, msg.topic))
         {
-            // Compute the total size for the packet
-            size_t packet_size = sizeof(TCP_Header) + msg.size;
-            // Allocate memory for the entire packet
-            TCP_Package *p = (TCP_Package *)malloc(packet_size);
-            // If memory allocation fails, print an error message and return
-            if (!p)
+            // Build the packet once, on the first subscriber that needs it
+            if (!packet_ready)
             {
-                cerr << "Memory allocation failed!" << endl;
-                return;
+                // Initialize the packet header
+                p->hdr.ip = inet_addr(ip);
+                p->hdr.port = port;
+                p->hdr.length = packet_size;
+                p->hdr.data_type = rx_ns ? (msg.data_type | TRACE_FLAG) : msg.data_type;
+                strncpy(p->hdr.topic, msg.topic.c_str(), sizeof(p->hdr.topic) - 1);
+                p->hdr.topic[sizeof(p->hdr.topic) - 1] = '\0';
+
+                // Copy the data into the packet, after the extension if present
+                memcpy(p->data + ext_size, msg.data, msg.size);
+                packet_ready = true;
             }
 
-            // Initialize the packet header
-            p->hdr.ip = inet_addr(ip);
-            p->hdr.port = port;
-            p->hdr.length = packet_size;
-            p->hdr.data_type = msg.data_type;
-            strncpy(p->hdr.topic, msg.topic.c_str(), sizeof(p->hdr.topic) - 1);
-            p->hdr.topic[sizeof(p->hdr.topic) - 1] = '\0';
+            // Stamp the send time right before sending
+            if (rx_ns)
+            {
+                TraceExtension ext = {rx_ns, NowNs()};
+                memcpy(p->data, &ext, sizeof(ext));
+            }
 
-            // Initialize the data and copy it into the packet
-            memset(p->data, 0, msg.size); // Initialize data to zero
-            memcpy(p->data, msg.data, msg.size);
+            // Batch the packet for compressed clients
+            if (client.compress)
+            {
+                client.batch.insert(client.batch.end(), (char *)p, (char *)p + packet_size);
+                if (client.batch.size() >= COMPRESS_BLOCK_SIZE)
+                    FlushBatch(client, block);
+                continue;
+            }
 
             // Send the entire packet
             ssize_t sent_bytes = send_all(client.sockfd, (char *)p, packet_size);
@@ -89,9 +120,6 @@ void SendToSubscribers(const UDPMessage &msg, const vector<ClientInfo> &clients,
             {
                 cerr << "Error sending message to client " << client.client_id << endl;
             }
-
-            // Free allocated memory
-            free(p);
         }
     }
 }
@@ -117,6 +145,17 @@ int BindSockets(int port, int &tcp_socket, int &udp_socket, sockaddr_in &server_
     return 0;
 }
 
+// Function to find a connected client by its socket, returns NULL if there is none
+ClientInfo *FindClientBySocket(vector<ClientInfo> &clients, int sockfd)
+{
+    for (auto &client : clients)
+    {
+        if (client.is_connected && client.sockfd == sockfd)
+            return &client;
+    }
+    return NULL;
+}
+
 // Function to send empty packet to a client
 void SendEmptyPacket(int sockfd)
 {
@@ -131,33 +170,700 @@ void SendEmptyPacket(int sockfd)
     }
 }
 
+// Function to send empty packet to a client, through its compressed stream if it has one
+void CloseClientStream(int sockfd, vector<ClientInfo> &clients, uint8_t *block)
+{
+    ClientInfo *client = FindClientBySocket(clients, sockfd);
+    if (client && client->compress)
+    {
+        TCP_Header hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.length = sizeof(TCP_Header);
+        client->batch.insert(client->batch.end(), (char *)&hdr, (char *)&hdr + sizeof(hdr));
+        FlushBatch(*client, block);
+    }
+    else
+    {
+        SendEmptyPacket(sockfd);
+    }
+}
+
+// Function to switch a client to a compressed stream, acknowledged by a STREAM_COMPRESSED frame
+void StartCompressedStream(ClientInfo &client)
+{
+    // The acknowledgement is the last uncompressed frame, with a 4 byte payload so it is not
+    // mistaken for the empty packet that closes the connection
+    struct
+    {
+        TCP_Header hdr;
+        uint32_t block_size;
+    } ack;
+    memset(&ack, 0, sizeof(ack));
+    ack.hdr.length = sizeof(ack);
+    ack.hdr.data_type = STREAM_COMPRESSED;
+    ack.block_size = COMPRESS_BLOCK_SIZE;
+    if (send_all(client.sockfd, &ack, sizeof(ack)) < 0)
+    {
+        cerr << "Error sending message to client " << client.client_id << endl;
+        return;
+    }
+    client.compress = true;
+    client.batch.clear();
+}
+
+// Sampled latency tracing state
+struct TraceState
+{
+    int sample_every; // 0 disables tracing, N traces one datagram in N
+    uint64_t datagrams;
+};
+
+// Function to get the kernel receive timestamp of a datagram, or the current time
+uint64_t ReceiveTimestamp(msghdr &mh)
+{
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&mh); cmsg != NULL; cmsg = CMSG_NXTHDR(&mh, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+        {
+            timespec ts;
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+        }
+    }
+    return NowNs();
+}
+
+// Size of the buffer collecting capture records before they are written
+const size_t CAPTURE_BUFFER_SIZE = 1 << 16;
+
+// Capture file of incoming datagrams
+struct CaptureWriter
+{
+    int fd; // -1 when capture is disabled
+    char *buf;
+    size_t used;
+    uint64_t records;
+    bool prefault; // buf comes from AllocBuffer with prefault set
+};
+
+// Function to open a capture file for appending, writes the file header if it is new
+// An existing file must be a capture of the same version, records are not appended to anything else
+int OpenCapture(const char *path, CaptureWriter &capture, bool prefault)
+{
+    capture.fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (capture.fd < 0)
+    {
+        cerr << "Error opening capture file " << path << endl;
+        return -1;
+    }
+    off_t size = lseek(capture.fd, 0, SEEK_END);
+    if (size > 0)
+    {
+        CaptureFileHeader hdr;
+        if (pread(capture.fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+            memcmp(hdr.magic, CAPTURE_MAGIC, sizeof(hdr.magic)) != 0 || hdr.version != CAPTURE_VERSION)
+        {
+            cerr << "Invalid capture file " << path << ", not appending to it" << endl;
+            close(capture.fd);
+            capture.fd = -1;
+            return -1;
+        }
+    }
+    // Only a new, empty file gets a header
+    else
+    {
+        CaptureFileHeader hdr;
+        memcpy(hdr.magic, CAPTURE_MAGIC, sizeof(hdr.magic));
+        hdr.version = CAPTURE_VERSION;
+        hdr.reserved = 0;
+        if (write_all(capture.fd, &hdr, sizeof(hdr)) < 0)
+        {
+            cerr << "Error writing capture file header" << endl;
+            close(capture.fd);
+            capture.fd = -1;
+            return -1;
+        }
+    }
+    capture.buf = (char *)AllocBuffer(CAPTURE_BUFFER_SIZE, prefault);
+    if (!capture.buf)
+    {
+        close(capture.fd);
+        capture.fd = -1;
+        return -1;
+    }
+    capture.prefault = prefault;
+    capture.used = 0;
+    capture.records = 0;
+    return 0;
+}
+
+// Function to write the buffered capture records to the file
+void FlushCapture(CaptureWriter &capture)
+{
+    if (capture.fd >= 0 && capture.used > 0)
+    {
+        if (write_all(capture.fd, capture.buf, capture.used) < 0)
+        {
+            cerr << "Error writing capture file" << endl;
+        }
+        capture.used = 0;
+    }
+}
+
+// Function to append one datagram to the capture buffer
+void CaptureDatagram(CaptureWriter &capture, uint64_t ts_ns, const sockaddr_in &addr, const char *data, int len)
+{
+    if (capture.used + sizeof(CaptureRecord) + len > CAPTURE_BUFFER_SIZE)
+    {
+        FlushCapture(capture);
+    }
+    CaptureRecord rec = {ts_ns, addr.sin_addr.s_addr, ntohs(addr.sin_port), (uint16_t)len};
+    memcpy(capture.buf + capture.used, &rec, sizeof(rec));
+    memcpy(capture.buf + capture.used + sizeof(rec), data, len);
+    capture.used += sizeof(rec) + len;
+    capture.records++;
+}
+
+// Function to flush and close the capture file
+void CloseCapture(CaptureWriter &capture)
+{
+    if (capture.fd >= 0)
+    {
+        FlushCapture(capture);
+        close(capture.fd);
+        FreeBuffer(capture.buf, CAPTURE_BUFFER_SIZE, capture.prefault);
+        cerr << "Captured " << capture.records << " datagrams" << endl;
+        capture.fd = -1;
+    }
+}
+
+// Seconds between periodic snapshots when --snapshot-interval is not given
+const int DEFAULT_SNAPSHOT_INTERVAL = 10;
+
+// Subscription snapshot file
+struct SnapshotState
+{
+    const char *path; // NULL disables snapshots
+    int interval;     // Seconds between periodic snapshots, 0 only writes on shutdown
+    uint64_t next_ns; // Time of the next periodic snapshot
+    bool dirty;       // Subscriptions changed since the last snapshot
+    pid_t writer;     // Child writing the last snapshot, -1 if none
+    const char *map;  // Loaded snapshot, kept mapped for the topics of clients not back yet
+    size_t map_size;
+};
+
+// Function to serialize the subscriptions of all clients into a snapshot image
+vector<char> BuildSnapshot(const vector<ClientInfo> &clients)
+{
+    vector<char> image(sizeof(SnapshotHeader));
+    for (const auto &client : clients)
+    {
+        uint32_t topic_count = client.saved_topics ? client.saved_count : client.topics.size();
+        SnapshotClient rec = {(uint32_t)client.client_id.size(), topic_count};
+        image.insert(image.end(), (char *)&rec, (char *)&rec + sizeof(rec));
+        image.insert(image.end(), client.client_id.begin(), client.client_id.end());
+        // Topics never read since the load are copied as they are
+        if (client.saved_topics)
+        {
+            image.insert(image.end(), client.saved_topics, client.saved_topics + client.saved_size);
+        }
+        // Topics are shorter than MAX_TOPIC_SIZE, a length byte is enough
+        for (const auto &topic : client.topics)
+        {
+            image.push_back((char)topic.size());
+            image.insert(image.end(), topic.begin(), topic.end());
+        }
+    }
+    SnapshotHeader hdr;
+    memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+    hdr.version = SNAPSHOT_VERSION;
+    hdr.client_count = clients.size();
+    hdr.size = image.size();
+    memcpy(image.data(), &hdr, sizeof(hdr));
+    return image;
+}
+
+// Function to write a snapshot image through a temporary file renamed over path,
+// so a crash never leaves a partial snapshot behind
+int WriteSnapshot(const char *path, const vector<char> &image)
+{
+    string tmp_path = string(path) + ".tmp";
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        cerr << "Error opening snapshot file " << tmp_path << endl;
+        return -1;
+    }
+    if (write_all(fd, image.data(), image.size()) < 0 || fsync(fd) < 0)
+    {
+        cerr << "Error writing snapshot file " << tmp_path << endl;
+        close(fd);
+        unlink(tmp_path.c_str());
+        return -1;
+    }
+    close(fd);
+    if (rename(tmp_path.c_str(), path) < 0)
+    {
+        cerr << "Error renaming snapshot file to " << path << endl;
+        unlink(tmp_path.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+// Function to collect the snapshot writer, waiting for it if block is set
+// Returns 1 while it is still running, a failed write marks the state dirty again
+int ReapSnapshotWriter(SnapshotState &snapshot, bool block)
+{
+    if (snapshot.writer < 0)
+    {
+        return 0;
+    }
+    int status;
+    pid_t res = waitpid(snapshot.writer, &status, block ? 0 : WNOHANG);
+    if (res == 0)
+    {
+        return 1;
+    }
+    if (res < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        snapshot.dirty = true;
+    }
+    snapshot.writer = -1;
+    return 0;
+}
+
+// Function to write the snapshot if the subscriptions changed since the last one
+// A forked child builds and writes it from its copy of the clients, so neither the
+// serialization nor the fsync delays forwarding
+void SaveSnapshot(SnapshotState &snapshot, const vector<ClientInfo> &clients)
+{
+    snapshot.next_ns = NowNs() + snapshot.interval * 1000000000ULL;
+    // One writer at a time, changes made meanwhile go in the next snapshot
+    if (ReapSnapshotWriter(snapshot, false) == 1 || !snapshot.dirty)
+    {
+        return;
+    }
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        cerr << "Error starting snapshot writer" << endl;
+        return;
+    }
+    if (pid == 0)
+    {
+        // Client sockets must close when the server closes them, not when the writer exits
+        close_range(STDERR_FILENO + 1, ~0U, 0);
+        _exit(WriteSnapshot(snapshot.path, BuildSnapshot(clients)) == 0 ? 0 : 1);
+    }
+    snapshot.writer = pid;
+    snapshot.dirty = false;
+}
+
+// Function to write the last snapshot on shutdown, once the running writer is done
+void FinishSnapshot(SnapshotState &snapshot, const vector<ClientInfo> &clients)
+{
+    ReapSnapshotWriter(snapshot, true);
+    if (snapshot.dirty && WriteSnapshot(snapshot.path, BuildSnapshot(clients)) == 0)
+    {
+        snapshot.dirty = false;
+    }
+}
+
+// Function to get the poll timeout in milliseconds until the next periodic snapshot
+int SnapshotTimeout(const SnapshotState &snapshot)
+{
+    uint64_t now = NowNs();
+    if (now >= snapshot.next_ns)
+    {
+        return 0;
+    }
+    // Round up so poll does not wake up just before the deadline
+    return (snapshot.next_ns - now + 999999) / 1000000;
+}
+
+// Function to read the saved topics of a client loaded from a snapshot, when it reconnects
+void LoadClientTopics(ClientInfo &client)
+{
+    const char *p = client.saved_topics;
+    if (!p)
+    {
+        return;
+    }
+    for (uint32_t t = 0; t < client.saved_count; t++)
+    {
+        uint8_t len = *p;
+        // Topics were written in set order, so each one goes at the end
+        client.topics.emplace_hint(client.topics.end(), p + 1, len);
+        p += 1 + len;
+    }
+    client.saved_topics = NULL;
+}
+
+// Function to load the clients of a snapshot file, all of them disconnected
+// Only the records are checked, the topics stay in the mapping until their client reconnects
+// A missing file is not an error, the server then starts without clients and returns 1
+int LoadSnapshot(SnapshotState &snapshot, vector<ClientInfo> &clients)
+{
+    const char *path = snapshot.path;
+    uint64_t start = NowNs();
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        if (errno == ENOENT)
+        {
+            return 1;
+        }
+        cerr << "Error opening snapshot file " << path << endl;
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(SnapshotHeader))
+    {
+        cerr << "Invalid snapshot file " << path << endl;
+        close(fd);
+        return -1;
+    }
+    size_t size = st.st_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        cerr << "Error mapping snapshot file " << path << endl;
+        return -1;
+    }
+    const char *base = (const char *)map;
+    SnapshotHeader hdr;
+    memcpy(&hdr, base, sizeof(hdr));
+    bool valid = memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic)) == 0 && hdr.version == SNAPSHOT_VERSION &&
+                 hdr.size == size;
+    // Every client takes at least a record, so a larger count cannot be walked
+    if (valid && hdr.client_count > (size - sizeof(hdr)) / sizeof(SnapshotClient))
+    {
+        valid = false;
+    }
+
+    // Walk the records, checking every length against the end of the file
+    vector<ClientInfo> loaded;
+    loaded.reserve(valid ? hdr.client_count : 0);
+    size_t offset = sizeof(hdr);
+    size_t subscriptions = 0;
+    for (uint32_t c = 0; valid && c < hdr.client_count; c++)
+    {
+        SnapshotClient rec;
+        if (offset + sizeof(rec) > size)
+        {
+            valid = false;
+            break;
+        }
+        memcpy(&rec, base + offset, sizeof(rec));
+        offset += sizeof(rec);
+        if (rec.id_length > MAX_ID_SIZE || offset + rec.id_length > size)
+        {
+            valid = false;
+            break;
+        }
+        string id(base + offset, rec.id_length);
+        offset += rec.id_length;
+        size_t topics_start = offset;
+        for (uint32_t t = 0; t < rec.topic_count; t++)
+        {
+            if (offset >= size || offset + 1 + (uint8_t)base[offset] > size)
+            {
+                valid = false;
+                break;
+            }
+            offset += 1 + (uint8_t)base[offset];
+        }
+        loaded.push_back({0, false, id, set<string>(), false, vector<char>(), base + topics_start, rec.topic_count,
+                          offset - topics_start});
+        subscriptions += rec.topic_count;
+    }
+    if (!valid || offset != size)
+    {
+        cerr << "Invalid snapshot file " << path << endl;
+        munmap(map, size);
+        return -1;
+    }
+    clients.swap(loaded);
+    snapshot.map = base;
+    snapshot.map_size = size;
+    cerr << "Loaded " << clients.size() << " clients, " << subscriptions << " subscriptions from " << path << " in "
+         << fixed << setprecision(3) << (NowNs() - start) / 1e6 << " ms" << endl;
+    return 0;
+}
+
+// Overload levels, each one sheds more than the previous
+const int LOAD_NORMAL = 0;
+const int LOAD_SHED_LOW = 1;    // Low priority topics are dropped
+const int LOAD_SHED_SAMPLE = 2; // Other topics are sampled as well
+// Time between two measurements of the bytes queued to subscribers, in nanoseconds
+const uint64_t OUTQ_CHECK_NS = 10000000;
+// Default of --shed-sample
+const int DEFAULT_SHED_SAMPLE = 10;
+// Time between two reports while overloaded, in nanoseconds
+const uint64_t OVERLOAD_REPORT_NS = 1000000000;
+// Time shedding is kept after the pressure last reached LOAD_SHED_LOW, in nanoseconds
+// Shedding brings the lag down right away, stopping at once would only start over
+const uint64_t OVERLOAD_HOLD_NS = 1000000000;
+
+// Overload detection and ingress load shedding
+// Pressure is the highest measurement over its watermark. A level is entered when
+// pressure reaches it and left when pressure falls under half of it, except that
+// shedding stops only after pressure stayed under 1 for OVERLOAD_HOLD_NS.
+struct OverloadState
+{
+    uint64_t lag_mark;           // Datagram receive to processing delay watermark in ns, 0 disables it
+    uint64_t outq_mark;          // Bytes queued to subscribers watermark, 0 disables it
+    int sample_every;            // At LOAD_SHED_SAMPLE one in sample_every other datagrams is forwarded
+    set<string> low_priority;    // Patterns of the topics shed first
+    uint64_t lag;                // Moving average of the delay of the last datagrams
+    uint64_t outq;               // Last measurement of the bytes queued to subscribers
+    uint64_t outq_checked_ns;
+    uint32_t kernel_drops;       // SO_RXQ_OVFL counter, datagrams dropped by a full receive buffer
+    int level;
+    uint64_t level_since_ns; // Start of the current overload period
+    uint64_t level_held_ns;  // Last time pressure reached LOAD_SHED_LOW
+    uint64_t reported_ns;    // Last report of the current overload period
+    uint64_t sampled;        // Datagrams considered for sampling
+    uint64_t shed_low;       // Totals since startup
+    uint64_t shed_sampled;
+    uint64_t period_low; // Totals of the current overload period
+    uint64_t period_sampled;
+};
+
+// Function to check if overload control is enabled
+bool OverloadEnabled(const OverloadState &overload)
+{
+    return overload.lag_mark > 0 || overload.outq_mark > 0;
+}
+
+// Function to get the SO_RXQ_OVFL drop counter of a datagram, returns false if it has none
+bool ReceiveDropCount(msghdr &mh, uint32_t &drops)
+{
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&mh); cmsg != NULL; cmsg = CMSG_NXTHDR(&mh, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL)
+        {
+            memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+            return true;
+        }
+    }
+    return false;
+}
+
+// Function to get the bytes waiting to reach subscribers, in socket send queues and batches
+uint64_t PendingOutboundBytes(const vector<ClientInfo> &clients)
+{
+    uint64_t total = 0;
+    for (const auto &client : clients)
+    {
+        if (!client.is_connected)
+            continue;
+        int queued = 0;
+        if (ioctl(client.sockfd, SIOCOUTQ, &queued) == 0)
+            total += queued;
+        total += client.batch.size();
+    }
+    return total;
+}
+
+// Function to print the overload level and the measurements that set it
+void PrintOverload(const OverloadState &overload)
+{
+    cerr << "Overload level " << overload.level << ": lag " << fixed << setprecision(1) << overload.lag / 1e6
+         << " ms, " << overload.outq / 1024 << " KiB queued, " << overload.kernel_drops << " kernel drops, ";
+    if (overload.level == LOAD_SHED_LOW)
+        cerr << "shedding low priority topics";
+    else
+        cerr << "shedding low priority topics and forwarding 1 in " << overload.sample_every << " others";
+}
+
+// Function to update the overload level with the measurements of one datagram
+// lag is the delay between its kernel receive time and now, drops the SO_RXQ_OVFL counter if present
+void UpdateOverload(OverloadState &overload, const vector<ClientInfo> &clients, uint64_t lag, bool has_drops,
+                    uint32_t drops)
+{
+    uint64_t now = NowNs();
+    // Datagrams of one burst wait for each other, average them so the level does not flap
+    overload.lag = (overload.lag * 7 + lag) / 8;
+    if (overload.outq_mark > 0 && now - overload.outq_checked_ns >= OUTQ_CHECK_NS)
+    {
+        overload.outq = PendingOutboundBytes(clients);
+        overload.outq_checked_ns = now;
+    }
+    // The counter counts from socket creation and only shows up once it is not 0
+    bool new_drops = has_drops && drops != overload.kernel_drops;
+    if (new_drops)
+    {
+        overload.kernel_drops = drops;
+    }
+
+    double pressure = 0;
+    if (overload.lag_mark > 0)
+        pressure = max(pressure, (double)overload.lag / overload.lag_mark);
+    if (overload.outq_mark > 0)
+        pressure = max(pressure, (double)overload.outq / overload.outq_mark);
+    // A full receive buffer is overload whatever the other measurements say
+    if (new_drops)
+        pressure = max(pressure, 1.0);
+
+    int level = overload.level;
+    while (level < LOAD_SHED_SAMPLE && pressure >= level + 1)
+        level++;
+    while (level > LOAD_SHED_LOW && pressure < level * 0.5)
+        level--;
+    if (pressure >= LOAD_SHED_LOW)
+        overload.level_held_ns = now;
+    if (level == LOAD_SHED_LOW && pressure < 0.5 && now - overload.level_held_ns >= OVERLOAD_HOLD_NS)
+        level = LOAD_NORMAL;
+
+    // Report the start and the end of an overload period, and its progress once in a while
+    if (overload.level == LOAD_NORMAL && level > LOAD_NORMAL)
+    {
+        overload.level = level;
+        overload.level_since_ns = now;
+        overload.reported_ns = now;
+        overload.period_low = 0;
+        overload.period_sampled = 0;
+        PrintOverload(overload);
+        cerr << endl;
+    }
+    else if (overload.level > LOAD_NORMAL && level == LOAD_NORMAL)
+    {
+        overload.level = level;
+        cerr << "Overload cleared after " << fixed << setprecision(3) << (now - overload.level_since_ns) / 1e9
+             << " s: shed " << overload.period_low << " low priority and " << overload.period_sampled
+             << " sampled datagrams" << endl;
+    }
+    else if (level > LOAD_NORMAL && now - overload.reported_ns >= OVERLOAD_REPORT_NS)
+    {
+        overload.level = level;
+        overload.reported_ns = now;
+        PrintOverload(overload);
+        cerr << ", shed " << overload.period_low << " low priority and " << overload.period_sampled
+             << " sampled datagrams so far" << endl;
+    }
+    else
+    {
+        overload.level = level;
+    }
+}
+
+// Function to check if a datagram on topic is shed at the current overload level
+bool ShedDatagram(OverloadState &overload, const string &topic)
+{
+    if (overload.level == LOAD_NORMAL)
+    {
+        return false;
+    }
+    // Patterns are matched like subscriptions, so a topic is shed exactly when it would be routed to them
+    if (FindTopic(overload.low_priority, topic))
+    {
+        overload.shed_low++;
+        overload.period_low++;
+        return true;
+    }
+    if (overload.level == LOAD_SHED_SAMPLE && overload.sampled++ % overload.sample_every != 0)
+    {
+        overload.shed_sampled++;
+        overload.period_sampled++;
+        return true;
+    }
+    return false;
+}
+
+// Function to print what overload control shed since startup
+void PrintShedReport(const OverloadState &overload)
+{
+    if (OverloadEnabled(overload))
+    {
+        cerr << "Shed " << overload.shed_low << " low priority and " << overload.shed_sampled
+             << " sampled datagrams, kernel dropped " << overload.kernel_drops << endl;
+    }
+}
+
+// Datagrams read per UDP poll event at most
+const int UDP_DRAIN_BATCH = 64;
+
 // Function to receive UDP message and send it to subscribers
-void UDPFlow(int udp_socket, vector<ClientInfo> &clients)
+// flags are passed to recvmsg, returns the result of recvmsg
+int UDPFlow(int udp_socket, vector<ClientInfo> &clients, char *buffer, TCP_Package *packet, TraceState &trace,
+            CaptureWriter &capture, OverloadState &overload, uint8_t *block, int flags)
 {
-    // Receive message UDP
-    char buffer[MAX_STRING_SIZE];
+    // Receive message UDP, with its timestamp when tracing, capturing or detecting overload
+    // and the drop counter when detecting overload
     sockaddr_in client_addr;
-    socklen_t addr_len = sizeof(client_addr);
-    int bytes_read = recvfrom(udp_socket, buffer, sizeof(buffer), 0, (struct sockaddr *)&client_addr, &addr_len);
+    iovec iov = {buffer, (size_t)MAX_DATAGRAM_SIZE};
+    char control[CMSG_SPACE(sizeof(timespec)) + CMSG_SPACE(sizeof(uint32_t))];
+    msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_name = &client_addr;
+    mh.msg_namelen = sizeof(client_addr);
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+    int bytes_read = recvmsg(udp_socket, &mh, flags);
 
     // If bytes read is greater than 0
     if (bytes_read > 0)
     {
+        // Only sampled datagrams carry a trace extension
+        uint64_t rx_ns = 0;
+        if (trace.sample_every > 0 && trace.datagrams++ % trace.sample_every == 0)
+        {
+            rx_ns = ReceiveTimestamp(mh);
+        }
+        // Record the datagram as received, before any parsing
+        if (capture.fd >= 0)
+        {
+            CaptureDatagram(capture, rx_ns ? rx_ns : ReceiveTimestamp(mh), client_addr, buffer, bytes_read);
+        }
+        // A datagram without a payload would reach subscribers as an empty frame, the end of the stream
+        if (bytes_read <= MAX_TOPIC_SIZE)
+        {
+            return bytes_read;
+        }
         // Parse the UDP message
         UDPMessage udpMsg = ParseUDPMessage(buffer, bytes_read);
+        // Unknown data types would reach subscribers as trace or stream control flags
+        if (udpMsg.data_type > MAX_DATA_TYPE)
+        {
+            return bytes_read;
+        }
+        // Measure how far behind the loop is and drop the datagram if the server is overloaded
+        if (OverloadEnabled(overload))
+        {
+            uint64_t now = NowNs();
+            uint64_t received = rx_ns ? rx_ns : ReceiveTimestamp(mh);
+            uint32_t drops = 0;
+            bool has_drops = ReceiveDropCount(mh, drops);
+            UpdateOverload(overload, clients, now > received ? now - received : 0, has_drops, drops);
+            if (ShedDatagram(overload, udpMsg.topic))
+            {
+                return bytes_read;
+            }
+        }
         char client_ip[INET_ADDRSTRLEN];
         inet_ntop(AF_INET, &(client_addr.sin_addr), client_ip, INET_ADDRSTRLEN);
         int client_port = ntohs(client_addr.sin_port);
         // Send the message to subscribers
-        SendToSubscribers(udpMsg, clients, client_ip, client_port);
+        SendToSubscribers(udpMsg, clients, client_ip, client_port, packet, rx_ns, block);
+    }
+    else if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        // Non-blocking socket already drained, nothing to do
     }
     else
     {
         cerr << "Error receiving UDP message" << endl;
     }
+    return bytes_read;
 }
 
-int TCPServerFlow(int tcp_socket, vector<pollfd> &pfds, vector<ClientInfo> &clients)
+int TCPServerFlow(int tcp_socket, vector<pollfd> &pfds, vector<ClientInfo> &clients, bool low_latency,
+                  bool &subscriptions_changed)
 {
     int bytes_read = 0;
     // Accept new connection
@@ -227,6 +933,10 @@ int TCPServerFlow(int tcp_socket, vector<pollfd> &pfds, vector<ClientInfo> &clie
                     restart = true;
                     clients[i].sockfd = new_socket;
                     clients[i].is_connected = true;
+                    // Every connection starts uncompressed
+                    clients[i].compress = false;
+                    clients[i].batch.clear();
+                    LoadClientTopics(clients[i]);
                 }
                 break;
             }
@@ -239,7 +949,18 @@ int TCPServerFlow(int tcp_socket, vector<pollfd> &pfds, vector<ClientInfo> &clie
 
         // If it is new client, add it to clients vector
         if (!restart)
-            clients.push_back({new_socket, true, string(client_id), set<string>()});
+        {
+            clients.push_back(
+                {new_socket, true, string(client_id), set<string>(), false, vector<char>(), NULL, 0, 0});
+            subscriptions_changed = true;
+        }
+
+        // In low-latency mode the main loop spins on the client socket
+        if (low_latency)
+        {
+            SetNonBlocking(new_socket);
+            SetBusyPoll(new_socket, BUSY_POLL_USEC);
+        }
 
         // Print that a new client has connecte
         cout << "New client " << client_id << " connected from " << client_ip << ":" << client_port << endl;
@@ -252,7 +973,84 @@ int TCPServerFlow(int tcp_socket, vector<pollfd> &pfds, vector<ClientInfo> &clie
     return 0;
 }
 
-void ClientSocketFlow(int i, vector<pollfd> &pfds, vector<ClientInfo> &clients)
+// Function to receive the topic list of a bulk command and apply it to the client in one batch
+// client is NULL if the sender is unknown, the list is still read to keep the stream in sync
+// Returns -1 if the list is malformed, the rest of the stream can then not be trusted
+int BulkSubscribeFlow(int sockfd, uint8_t command, ClientInfo *client)
+{
+    BulkSubscribeHeader bh;
+    // Every topic takes at least a character and its terminator
+    if (receive_all(sockfd, &bh, sizeof(bh)) != sizeof(bh) || bh.length > MAX_BULK_SIZE || bh.count > bh.length / 2)
+    {
+        return -1;
+    }
+    vector<char> list(bh.length);
+    if (bh.length > 0 && receive_all(sockfd, list.data(), bh.length) != (ssize_t)bh.length)
+    {
+        return -1;
+    }
+    // Split the list, every topic must be terminated and fit in a SubscribeMessage
+    vector<string> topics;
+    topics.reserve(bh.count);
+    size_t start = 0;
+    for (size_t j = 0; j < list.size(); j++)
+    {
+        if (list[j] == '\0')
+        {
+            if (j == start || j - start >= MAX_TOPIC_SIZE)
+            {
+                return -1;
+            }
+            topics.emplace_back(list.data() + start, j - start);
+            start = j + 1;
+        }
+    }
+    if (start != list.size() || topics.size() != bh.count)
+    {
+        return -1;
+    }
+    if (!client)
+    {
+        return 0;
+    }
+    if (command == CMD_BULK_SUBSCRIBE)
+    {
+        // Sorted topics are inserted next to each other instead of each searched from the root
+        sort(topics.begin(), topics.end());
+        client->topics.insert(topics.begin(), topics.end());
+    }
+    else
+    {
+        for (const auto &topic : topics)
+        {
+            client->topics.erase(topic);
+        }
+    }
+    return 0;
+}
+
+// Function to close the connection of the client at index i of the poll set
+void DisconnectClient(int i, vector<pollfd> &pfds, vector<ClientInfo> &clients)
+{
+    // Find the client by its socket
+    ClientInfo *client = FindClientBySocket(clients, pfds[i].fd);
+    if (client)
+    {
+        // Print that the client has disconnected
+        cout << "Client " << client->client_id << " disconnected." << endl;
+        // Set the client as disconnected
+        client->is_connected = false;
+        client->sockfd = 0;
+        client->compress = false;
+        client->batch.clear();
+    }
+    // Close the socket
+    close(pfds[i].fd);
+    // Remove the closed socket from the poll set
+    pfds.erase(pfds.begin() + i);
+}
+
+void ClientSocketFlow(int i, vector<pollfd> &pfds, vector<ClientInfo> &clients, bool &subscriptions_changed)
 {
     // Receive message from client
     SubscribeMessage msg;
@@ -261,25 +1059,43 @@ void ClientSocketFlow(int i, vector<pollfd> &pfds, vector<ClientInfo> &clients)
     // If bytes a more than 0 then message is received
     if (bytes_read > 0)
     {
+        // The topic is not always terminated by the sender
+        msg.topic[MAX_TOPIC_SIZE - 1] = '\0';
+        // Clients loaded from a snapshot or reconnected are not in pfds order, find the sender by socket
+        ClientInfo *sender = FindClientBySocket(clients, pfds[i].fd);
         // If it is subscribe command add the topic to the client
-        if (msg.command == 1)
+        if (msg.command == CMD_SUBSCRIBE)
         {
-            for (size_t j = 0; j < clients.size(); j++)
+            if (sender && sender->topics.insert(msg.topic).second)
             {
-                if (clients[j].client_id == clients[i - 3].client_id)
-                {
-                    clients[j].topics.insert(msg.topic);
-                }
+                subscriptions_changed = true;
             }
         } // If it is unsubscribe command remove the topic from the client
-        else if (msg.command == 0)
+        else if (msg.command == CMD_UNSUBSCRIBE)
         {
-            for (size_t j = 0; j < clients.size(); j++)
+            if (sender && sender->topics.erase(msg.topic) > 0)
             {
-                if (clients[j].client_id == clients[i - 3].client_id)
-                {
-                    clients[j].topics.erase(msg.topic);
-                }
+                subscriptions_changed = true;
+            }
+        } // If it is a bulk command apply the whole topic list at once
+        else if (msg.command == CMD_BULK_SUBSCRIBE || msg.command == CMD_BULK_UNSUBSCRIBE)
+        {
+            if (BulkSubscribeFlow(pfds[i].fd, msg.command, sender) < 0)
+            {
+                // A rejected body may be partly unread, it would be parsed as commands
+                cerr << "Invalid bulk subscription" << endl;
+                DisconnectClient(i, pfds, clients);
+            }
+            else if (sender)
+            {
+                subscriptions_changed = true;
+            }
+        } // If it is compress command switch the client to a compressed stream
+        else if (msg.command == CMD_COMPRESS)
+        {
+            if (sender)
+            {
+                StartCompressedStream(*sender);
             }
         } // Else print invalid command
         else
@@ -289,26 +1105,7 @@ void ClientSocketFlow(int i, vector<pollfd> &pfds, vector<ClientInfo> &clients)
     } // If bytes read is 0, client disconnected
     else if (bytes_read == 0)
     {
-        // Find the client by its socket
-        ClientInfo *client;
-        for (size_t j = 0; j < clients.size(); j++)
-        {
-            if (clients[j].sockfd == pfds[i].fd)
-            {
-                client = &clients[j];
-                break;
-            }
-        }
-        // Print that the client has disconnected
-        cout << "Client "
-             << client->client_id << " disconnected." << endl;
-        // Set the client as disconnected
-        client->is_connected = false;
-        client->sockfd = 0;
-        // Close the socket
-        close(pfds[i].fd);
-        // Remove the closed socket from the poll set
-        pfds.erase(pfds.begin() + i);
+        DisconnectClient(i, pfds, clients);
     }
     else
     {
@@ -316,19 +1113,133 @@ void ClientSocketFlow(int i, vector<pollfd> &pfds, vector<ClientInfo> &clients)
     }
 }
 
+// Server command line options
+struct ServerOptions
+{
+    int port;
+    bool low_latency;
+    int cpu;
+    int trace_every;
+    const char *capture_path;
+    const char *snapshot_path;
+    int snapshot_interval;
+    double shed_lag_ms; // Overload watermarks, 0 disables them
+    int shed_outq_kib;
+    int shed_sample;
+    set<string> low_priority;
+};
+
+// Function to print usage
+void PrintUsage(const char *name)
+{
+    cerr << "Usage: " << name << " <port> [--low-latency <cpu>] [--trace <N>] [--capture <file>] [--snapshot <file>]"
+         << " [--snapshot-interval <seconds>] [--shed-lag <ms>] [--shed-outq <KiB>] [--shed-sample <N>]"
+         << " [--low-priority <pattern>]..." << endl;
+}
+
+// Function to parse command line options, returns -1 on invalid arguments
+int ParseServerOptions(int argc, char *argv[], ServerOptions &options)
+{
+    static const option long_options[] = {
+        {"low-latency", required_argument, NULL, 'l'},
+        {"trace", required_argument, NULL, 't'},
+        {"capture", required_argument, NULL, 'c'},
+        {"snapshot", required_argument, NULL, 's'},
+        {"snapshot-interval", required_argument, NULL, 'i'},
+        {"shed-lag", required_argument, NULL, 'a'},
+        {"shed-outq", required_argument, NULL, 'o'},
+        {"shed-sample", required_argument, NULL, 'm'},
+        {"low-priority", required_argument, NULL, 'p'},
+        {NULL, 0, NULL, 0}};
+
+    options.low_latency = false;
+    options.cpu = -1;
+    options.trace_every = 0;
+    options.capture_path = NULL;
+    options.snapshot_path = NULL;
+    options.snapshot_interval = DEFAULT_SNAPSHOT_INTERVAL;
+    options.shed_lag_ms = 0;
+    options.shed_outq_kib = 0;
+    options.shed_sample = 0;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "l:t:c:s:i:a:o:m:p:", long_options, NULL)) != -1)
+    {
+        if (opt == 'l')
+        {
+            options.low_latency = true;
+            options.cpu = atoi(optarg);
+        }
+        else if (opt == 't' && atoi(optarg) >= 0)
+        {
+            options.trace_every = atoi(optarg);
+        }
+        else if (opt == 'c')
+        {
+            options.capture_path = optarg;
+        }
+        else if (opt == 's')
+        {
+            options.snapshot_path = optarg;
+        }
+        else if (opt == 'i' && atoi(optarg) >= 0)
+        {
+            options.snapshot_interval = atoi(optarg);
+        }
+        else if (opt == 'a' && atof(optarg) > 0)
+        {
+            options.shed_lag_ms = atof(optarg);
+        }
+        else if (opt == 'o' && atoi(optarg) > 0)
+        {
+            options.shed_outq_kib = atoi(optarg);
+        }
+        else if (opt == 'm' && atoi(optarg) > 0)
+        {
+            options.shed_sample = atoi(optarg);
+        }
+        else if (opt == 'p' && strlen(optarg) < MAX_TOPIC_SIZE)
+        {
+            options.low_priority.insert(optarg);
+        }
+        else
+        {
+            return -1;
+        }
+    }
+    // Exactly one positional argument, the port
+    if (optind != argc - 1)
+    {
+        return -1;
+    }
+    // Shedding only starts once a watermark is crossed, without one these would do nothing
+    if ((options.shed_sample > 0 || !options.low_priority.empty()) && options.shed_lag_ms == 0 &&
+        options.shed_outq_kib == 0)
+    {
+        cerr << "--low-priority and --shed-sample need --shed-lag or --shed-outq" << endl;
+        return -1;
+    }
+    if (options.shed_sample == 0)
+    {
+        options.shed_sample = DEFAULT_SHED_SAMPLE;
+    }
+    options.port = atoi(argv[optind]);
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     // Disable buffering for stdout
     setvbuf(stdout, NULL, _IONBF, BUFSIZ);
-    // Check if the number of arguments is correct
-    if (argc < 2 || argc > 2)
+    // Check if the arguments are correct
+    ServerOptions options;
+    if (ParseServerOptions(argc, argv, options) < 0)
     {
-        cerr << "Usage: " << argv[0] << " <port>" << endl;
+        PrintUsage(argv[0]);
         return 1;
     }
 
     // Create TCP and UDP sockets
-    int port = atoi(argv[1]);
+    int port = options.port;
     int tcp_socket = socket(AF_INET, SOCK_STREAM, 0);
     if (tcp_socket < 0)
     {
@@ -365,6 +1276,60 @@ int main(int argc, char *argv[])
     // Prepare TCP socket for listening
     listen(tcp_socket, LISTEN_QUEUE_SIZE);
 
+    // In low-latency mode pin the loop to a core and spin on non-blocking sockets
+    if (options.low_latency)
+    {
+        if (options.cpu >= 0)
+            PinToCore(options.cpu);
+        SetNonBlocking(udp_socket);
+        SetNonBlocking(tcp_socket);
+        SetBusyPoll(udp_socket, BUSY_POLL_USEC);
+    }
+    // Open the capture file, if requested
+    CaptureWriter capture = {-1, NULL, 0, 0, false};
+    if (options.capture_path && OpenCapture(options.capture_path, capture, options.low_latency) < 0)
+    {
+        close(tcp_socket);
+        close(udp_socket);
+        return 1;
+    }
+    // Overload control, measuring the lag of every datagram and the receive buffer drops
+    OverloadState overload = {};
+    overload.lag_mark = (uint64_t)(options.shed_lag_ms * 1e6);
+    overload.outq_mark = (uint64_t)options.shed_outq_kib * 1024;
+    overload.sample_every = options.shed_sample;
+    overload.low_priority = options.low_priority;
+    overload.level = LOAD_NORMAL;
+    if (OverloadEnabled(overload))
+    {
+        int on = 1;
+        if (setsockopt(udp_socket, SOL_SOCKET, SO_RXQ_OVFL, (char *)&on, sizeof(on)) < 0)
+        {
+            cerr << "Warning: SO_RXQ_OVFL not available, kernel drops are not counted" << endl;
+        }
+    }
+    // When tracing, capturing or detecting overload, ask the kernel to timestamp every received datagram
+    TraceState trace = {options.trace_every, 0};
+    if (trace.sample_every > 0 || capture.fd >= 0 || OverloadEnabled(overload))
+    {
+        int on = 1;
+        if (setsockopt(udp_socket, SOL_SOCKET, SO_TIMESTAMPNS, (char *)&on, sizeof(on)) < 0)
+        {
+            cerr << "Warning: SO_TIMESTAMPNS not available, using send side clock" << endl;
+        }
+    }
+    // Receive and packet buffers, reused for every UDP message
+    char *udp_buffer = (char *)AllocBuffer(MAX_DATAGRAM_SIZE, options.low_latency);
+    TCP_Package *packet = (TCP_Package *)AllocBuffer(MAX_PACKET_SIZE, options.low_latency);
+    // Block buffer for compressing client batches
+    uint8_t *block = (uint8_t *)AllocBuffer(sizeof(CompressedBlockHeader) + COMPRESS_BLOCK_MAX, options.low_latency);
+    if (!udp_buffer || !packet || !block)
+    {
+        close(tcp_socket);
+        close(udp_socket);
+        return 1;
+    }
+
     // Pool
     vector<pollfd> pfds;
     for (int i = 0; i < 3; i++)
@@ -381,16 +1346,36 @@ int main(int argc, char *argv[])
     pfds[0].fd = udp_socket;
     pfds[0].events = POLLIN;
 
-    // Vector of connected clients
+    // Vector of connected clients, restored from the snapshot so returning clients keep their topics
     vector<ClientInfo> clients;
+    SnapshotState snapshot = {options.snapshot_path, options.snapshot_interval, 0, false, -1, NULL, 0};
+    if (snapshot.path)
+    {
+        int res = LoadSnapshot(snapshot, clients);
+        if (res < 0)
+        {
+            close(tcp_socket);
+            close(udp_socket);
+            return 1;
+        }
+        // Without a snapshot file the first one is written even if nothing changes
+        snapshot.dirty = res == 1;
+        snapshot.next_ns = NowNs() + snapshot.interval * 1000000000ULL;
+    }
     // Exit flags
     bool exit_triggered = false;
     bool all_clients_disconnected = false;
     // Main loop
     while (true)
     {
-        // Wait for events
-        int ret = poll(pfds.data(), pfds.size(), -1);
+        // Wait for events, or just check for them when spinning in low-latency mode
+        int timeout = (options.low_latency && !exit_triggered) ? 0 : -1;
+        // Wake up in time for the next periodic snapshot
+        if (timeout < 0 && snapshot.path && snapshot.interval > 0)
+        {
+            timeout = SnapshotTimeout(snapshot);
+        }
+        int ret = poll(pfds.data(), pfds.size(), timeout);
         if (ret < 0)
         {
             cerr << "Error in poll" << endl;
@@ -398,13 +1383,21 @@ int main(int argc, char *argv[])
             close(udp_socket);
             return 1;
         }
+        if (snapshot.path && snapshot.interval > 0 && NowNs() >= snapshot.next_ns)
+        {
+            SaveSnapshot(snapshot, clients);
+        }
+        if (ret == 0)
+        {
+            continue;
+        }
         // Check for events
         for (size_t i = 0; i < pfds.size(); i++)
         {
             // If server is going to shutdown, send empty package to all clients for closing connection
             if (exit_triggered && i > 2)
             {
-                SendEmptyPacket(pfds[i].fd);
+                CloseClientStream(pfds[i].fd, clients, block);
             }
             // If the socket has data to read
             if ((pfds[i].revents & POLLIN) == POLLIN)
@@ -412,12 +1405,18 @@ int main(int argc, char *argv[])
                 // Check if the socket is the UDP socket
                 if (pfds[i].fd == udp_socket && !exit_triggered)
                 {
-                    // Receive and send UDP message
-                    UDPFlow(udp_socket, clients);
+                    // Receive and send UDP messages, draining a burst without waiting so
+                    // compressed clients get several frames per block
+                    for (int n = 0; n < UDP_DRAIN_BATCH; n++)
+                    {
+                        if (UDPFlow(udp_socket, clients, udp_buffer, packet, trace, capture, overload, block,
+                                    n > 0 ? MSG_DONTWAIT : 0) <= 0)
+                            break;
+                    }
                 } // Check if the socket is the TCP socket
                 else if (pfds[i].fd == tcp_socket && !exit_triggered)
                 {
-                    int res = TCPServerFlow(tcp_socket, pfds, clients);
+                    int res = TCPServerFlow(tcp_socket, pfds, clients, options.low_latency, snapshot.dirty);
                     if (res == 1)
                     {
                         continue;
@@ -444,7 +1443,7 @@ int main(int argc, char *argv[])
                 } // Else, the socket is a client socket
                 else
                 {
-                    ClientSocketFlow(i, pfds, clients);
+                    ClientSocketFlow(i, pfds, clients, snapshot.dirty);
                 }
             }
             // If exit is triggered and all clients are disconnected, set allClientsDisconnected
@@ -454,6 +1453,8 @@ int main(int argc, char *argv[])
                 break;
             }
         }
+        // Send what compressed clients got in this iteration
+        FlushBatches(clients, block);
         // If all clients are disconnected, shutdown the server
         if (all_clients_disconnected)
         {
@@ -465,6 +1466,19 @@ int main(int argc, char *argv[])
     close(tcp_socket);
     shutdown(udp_socket, SHUT_RD);
     close(udp_socket);
+    CloseCapture(capture);
+    PrintShedReport(overload);
+    if (snapshot.path)
+    {
+        FinishSnapshot(snapshot, clients);
+        if (snapshot.map)
+        {
+            munmap((void *)snapshot.map, snapshot.map_size);
+        }
+    }
+    FreeBuffer(udp_buffer, MAX_DATAGRAM_SIZE, options.low_latency);
+    FreeBuffer(packet, MAX_PACKET_SIZE, options.low_latency);
+    FreeBuffer(block, sizeof(CompressedBlockHeader) + COMPRESS_BLOCK_MAX, options.low_latency);
 
     return 0;
 }
\ No newline at end of file
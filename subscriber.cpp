@@ -1,17 +1,76 @@
 #include "helper.h"
+#include <map>
+#include <atomic>
+#include <thread>
+#include <sstream>
+#include <fstream>
 
 using namespace std;
 
-// Function to parse string
-string ParseString(uint8_t *data, int length)
+// Log2 histogram of latencies in nanoseconds, bucket b counts values in [2^b, 2^(b+1))
+struct LatencyHistogram
 {
-    char buf[MAX_STRING_SIZE] = {0};
-    memcpy(buf, data, length);
-    return string(buf);
+    uint64_t buckets[64];
+    uint64_t count;
+};
+
+// Latencies of traced messages on one topic
+struct TopicLatency
+{
+    LatencyHistogram broker;   // Server UDP receive to server send
+    LatencyHistogram delivery; // Server send to subscriber receive
+};
+
+// Function to add a latency to a histogram
+void RecordLatency(LatencyHistogram &h, int64_t ns)
+{
+    // Clocks of different hosts can be skewed, count negative values as 0
+    uint64_t value = ns > 0 ? ns : 0;
+    h.buckets[63 - __builtin_clzll(value | 1)]++;
+    h.count++;
+}
+
+// Function to get the upper bound of the bucket holding the p-th percentile, in microseconds
+double LatencyPercentile(const LatencyHistogram &h, double p)
+{
+    uint64_t rank = (uint64_t)ceil(p * h.count);
+    uint64_t seen = 0;
+    for (int b = 0; b < 64; b++)
+    {
+        seen += h.buckets[b];
+        if (seen >= rank && seen > 0)
+            return ldexp(1.0, b + 1) / 1000.0;
+    }
+    return 0;
+}
+
+// Function to print one histogram summary
+void PrintLatency(const char *name, const LatencyHistogram &h)
+{
+    cerr << " " << name << " p50<=" << LatencyPercentile(h, 0.5) << "us p99<=" << LatencyPercentile(h, 0.99)
+         << "us p999<=" << LatencyPercentile(h, 0.999) << "us";
+}
+
+// Function to print latency histograms of all traced topics to stderr
+void PrintLatencyReport(const map<string, TopicLatency> &latencies)
+{
+    for (const auto &entry : latencies)
+    {
+        cerr << "Latency " << entry.first << ": " << entry.second.broker.count << " traced,";
+        PrintLatency("broker", entry.second.broker);
+        PrintLatency("delivery", entry.second.delivery);
+        cerr << endl;
+    }
+}
+
+// Function to parse string, a full MAX_STRING_SIZE payload has no terminator
+string ParseString(const uint8_t *data, int length)
+{
+    return string((const char *)data, strnlen((const char *)data, length));
 }
 
 // Function to parse float
-float parseFloat(uint8_t *data)
+float parseFloat(const uint8_t *data)
 {
     uint32_t num;
     uint8_t exp = data[sizeof(uint32_t) + 1];
@@ -24,7 +83,7 @@ float parseFloat(uint8_t *data)
 }
 
 // Function to parse short real
-float ParseShortReal(uint8_t *data)
+float ParseShortReal(const uint8_t *data)
 {
     uint16_t num;
     memcpy(&num, data, sizeof(uint16_t));
@@ -32,7 +91,7 @@ float ParseShortReal(uint8_t *data)
 }
 
 // Function to parse int
-int32_t ParseInt(uint8_t *data)
+int32_t ParseInt(const uint8_t *data)
 {
     uint32_t num;
     memcpy(&num, data + 1, sizeof(uint32_t));
@@ -79,27 +138,27 @@ int ConectToServer(const char *server_ip, int port)
 }
 
 // Function to parse content depending on data type
-void ParseContent(uint8_t *content, TCP_Header h)
+void ParseContent(const uint8_t *content, TCP_Header h, ostream &out)
 {
     if (h.data_type == 0)
     {
         int32_t num = ParseInt(content);
-        cout << "INT - " << num << endl;
+        out << "INT - " << num << endl;
     }
     else if (h.data_type == 1)
     {
         float num = ParseShortReal(content);
-        cout << "SHORT_REAL - " << fixed << setprecision(2) << num << endl;
+        out << "SHORT_REAL - " << fixed << setprecision(2) << num << endl;
     }
     else if (h.data_type == 2)
     {
         float num = parseFloat(content);
-        cout << "FLOAT - " << fixed << setprecision(4) << num << endl;
+        out << "FLOAT - " << fixed << setprecision(4) << num << endl;
     }
     else if (h.data_type == 3)
     {
         string str = ParseString(content, h.length - sizeof(TCP_Header));
-        cout << "STRING - " << str << endl;
+        out << "STRING - " << str << endl;
     }
     else
     {
@@ -142,7 +201,7 @@ int StdinFlow(int server_sock)
         // If command is subscribe
         if (first_word == "subscribe")
         {
-            sub_msg.command = 1;
+            sub_msg.command = CMD_SUBSCRIBE;
             // Send subscribe message
             bytes_received = send_all(server_sock, &sub_msg, sizeof(SubscribeMessage));
             if (bytes_received < 0)
@@ -151,19 +210,20 @@ int StdinFlow(int server_sock)
             }
             else
             {
-                cout << "Subscribed to topic " << topic << endl;
+                // One write, so a line of the render thread cannot land inside it
+                cout << "Subscribed to topic " + topic + "\n";
             }
         } // If command is unsubscribe
         else if (first_word == "unsubscribe")
         {
-            sub_msg.command = 0;
+            sub_msg.command = CMD_UNSUBSCRIBE;
             // Send unsubscribe message
             bytes_received = send_all(server_sock, &sub_msg, sizeof(SubscribeMessage));
             if (bytes_received < 0)
             {
                 cerr << "Error sending unsubscribe message" << endl;
             }
-            cout << "Unsubscribed from topic " << topic << endl;
+            cout << "Unsubscribed from topic " + topic + "\n";
         } // Else print error message
         else
         {
@@ -173,38 +233,433 @@ int StdinFlow(int server_sock)
     return 0;
 }
 
-// TCP flow
-int TCPFLow(int server_sock)
+// Function to read a topics file, one topic per line, empty lines are skipped
+// Returns -1 if the file cannot be read or a topic is too long
+int ReadTopicsFile(const char *path, vector<string> &topics)
 {
-    TCP_Header h;
+    ifstream in(path);
+    if (!in)
+    {
+        cerr << "Error opening topics file " << path << endl;
+        return -1;
+    }
+    string line;
+    while (getline(in, line))
+    {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (line.empty())
+            continue;
+        if (line.size() >= MAX_TOPIC_SIZE)
+        {
+            cerr << "Topic too long in " << path << ": " << line << endl;
+            return -1;
+        }
+        topics.push_back(line);
+    }
+    return 0;
+}
+
+// Function to send topics with bulk commands, as few as MAX_BULK_SIZE allows
+int SendBulkSubscribe(int server_sock, uint8_t command, const vector<string> &topics)
+{
+    size_t next = 0;
+    while (next < topics.size())
+    {
+        // Command, header and topic list go out in one send
+        vector<char> frame(sizeof(SubscribeMessage) + sizeof(BulkSubscribeHeader), 0);
+        BulkSubscribeHeader bh = {0, 0};
+        while (next < topics.size() && bh.length + topics[next].size() + 1 <= MAX_BULK_SIZE)
+        {
+            frame.insert(frame.end(), topics[next].begin(), topics[next].end());
+            frame.push_back('\0');
+            bh.length += topics[next].size() + 1;
+            bh.count++;
+            next++;
+        }
+        frame[0] = command;
+        memcpy(frame.data() + sizeof(SubscribeMessage), &bh, sizeof(bh));
+        if (send_all(server_sock, frame.data(), frame.size()) < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Connection to the server, plain or compressed after the server acknowledged CMD_COMPRESS
+struct ServerStream
+{
+    int sock;
+    bool compressed;
+    bool compress_requested; // CMD_COMPRESS sent, waiting for the STREAM_COMPRESSED frame
+    uint8_t *packed; // Block as received, COMPRESS_BLOCK_MAX bytes
+    uint8_t *raw;    // Decompressed block, COMPRESS_BLOCK_MAX bytes
+    size_t raw_len;
+    size_t raw_pos; // Next frame in raw
+    uint64_t wire_bytes;
+    uint64_t raw_bytes;
+};
+
+// Function to receive and decompress the next block of a compressed stream
+// Returns 1 if the connection is closing, 0 on success
+int ReceiveBlock(ServerStream &s)
+{
+    CompressedBlockHeader bh;
+    int bytes_received = receive_all(s.sock, &bh, sizeof(bh));
+    if (bytes_received <= 0)
+    {
+        shutdown(s.sock, SHUT_RDWR);
+        return 1;
+    }
+    if (bh.raw_length > COMPRESS_BLOCK_MAX || bh.packed_length > bh.raw_length)
+    {
+        cerr << "Invalid compressed block" << endl;
+        shutdown(s.sock, SHUT_RDWR);
+        return 1;
+    }
+    // Stored blocks go straight to the raw buffer
+    uint8_t *dst = bh.packed_length == bh.raw_length ? s.raw : s.packed;
+    if (receive_all(s.sock, dst, bh.packed_length) != (ssize_t)bh.packed_length)
+    {
+        cerr << "Error receiving data from server" << endl;
+        shutdown(s.sock, SHUT_RDWR);
+        return 1;
+    }
+    if (dst == s.packed && LZDecompress(s.packed, bh.packed_length, s.raw, bh.raw_length) < 0)
+    {
+        cerr << "Corrupt compressed block" << endl;
+        shutdown(s.sock, SHUT_RDWR);
+        return 1;
+    }
+    s.raw_len = bh.raw_length;
+    s.raw_pos = 0;
+    s.wire_bytes += sizeof(bh) + bh.packed_length;
+    s.raw_bytes += bh.raw_length;
+    return 0;
+}
+
+// Function to check if frames of the last block are still waiting to be read
+bool HasBufferedFrames(const ServerStream &s)
+{
+    return s.compressed && s.raw_pos < s.raw_len;
+}
+
+// Function to receive one frame from the server into frame, a buffer of MAX_PACKET_SIZE bytes
+// Returns 1 if the connection is closing, 2 for the frame starting a compressed stream,
+// -1 if the frame is lost and 0 on success
+int ReceiveFrame(ServerStream &s, uint8_t *frame, uint64_t &rx_ns)
+{
+    int server_sock = s.sock;
+    TCP_Header *h = (TCP_Header *)frame;
+    // Compressed streams take the frame from the current block, or the next one
+    if (s.compressed)
+    {
+        if (s.raw_pos == s.raw_len && ReceiveBlock(s) != 0)
+        {
+            return 1;
+        }
+        if (s.raw_len - s.raw_pos < sizeof(TCP_Header))
+        {
+            cerr << "Invalid packet length" << endl;
+            shutdown(server_sock, SHUT_RDWR);
+            return 1;
+        }
+        memcpy(frame, s.raw + s.raw_pos, sizeof(TCP_Header));
+        if (h->length == sizeof(TCP_Header))
+        {
+            shutdown(server_sock, SHUT_RDWR);
+            return 1;
+        }
+        if (h->length < (int)sizeof(TCP_Header) || (size_t)h->length > MAX_PACKET_SIZE ||
+            (size_t)h->length > s.raw_len - s.raw_pos)
+        {
+            cerr << "Invalid packet length" << endl;
+            shutdown(server_sock, SHUT_RDWR);
+            return 1;
+        }
+        memcpy(frame, s.raw + s.raw_pos, h->length);
+        s.raw_pos += h->length;
+        if ((h->data_type & ~TRACE_FLAG) > MAX_DATA_TYPE)
+        {
+            cerr << "Invalid data type" << endl;
+            return -1;
+        }
+        rx_ns = (h->data_type & TRACE_FLAG) ? NowNs() : 0;
+        return 0;
+    }
     // Receive header of packet
-    int bytes_received = receive_all(server_sock, (uint8_t *)&h, sizeof(TCP_Header));
-    // If received packet with no data, shutdown server socket and break
-    if (h.length == sizeof(TCP_Header))
+    int bytes_received = receive_all(server_sock, frame, sizeof(TCP_Header));
+    // If received packet with no data, or the server is gone, shutdown server socket and break
+    if (bytes_received <= 0 || h->length == sizeof(TCP_Header))
     {
         shutdown(server_sock, SHUT_RDWR);
         return 1;
     }
-    // Allocate memory for content of packet
-    int data_size = h.length - sizeof(TCP_Header);
-    uint8_t *content = new uint8_t[data_size];
-    // Receive content of packet
-    bytes_received = receive_all(server_sock, content, data_size);
-    // If all data received
-    if (bytes_received == data_size)
-    {
-        // Print udp IP, port, topic
-        struct in_addr ip_addr;
-        ip_addr.s_addr = h.ip;
-        cout << inet_ntoa(ip_addr) << ":" << h.port << " - " << h.topic << " - ";
-        // Parse data based on data type and print it
-        ParseContent(content, h);
+    // Check that the rest of the packet fits in the buffer
+    int data_size = h->length - sizeof(TCP_Header);
+    if (data_size < 0 || (size_t)h->length > MAX_PACKET_SIZE)
+    {
+        cerr << "Invalid packet length" << endl;
+        shutdown(server_sock, SHUT_RDWR);
+        return 1;
     }
-    else
+    // Receive content of packet, with the trace extension if any
+    bytes_received = receive_all(server_sock, frame + sizeof(TCP_Header), data_size);
+    if (bytes_received != data_size)
     {
         cerr << "Error receiving data from server" << endl;
+        return -1;
+    }
+    // From the next byte on, the server sends compressed blocks. Only the exact
+    // acknowledgement of our own CMD_COMPRESS switches the stream.
+    if (h->data_type == STREAM_COMPRESSED && s.compress_requested && data_size == sizeof(uint32_t))
+    {
+        s.compress_requested = false;
+        s.compressed = true;
+        s.raw_len = 0;
+        s.raw_pos = 0;
+        return 2;
+    }
+    if ((h->data_type & ~TRACE_FLAG) > MAX_DATA_TYPE)
+    {
+        cerr << "Invalid data type" << endl;
+        return -1;
+    }
+    // Receive time only matters for traced packets
+    rx_ns = (h->data_type & TRACE_FLAG) ? NowNs() : 0;
+    return 0;
+}
+
+// Function to print one frame received at rx_ns, recording its latencies if it is traced
+void PrintFrame(const uint8_t *frame, uint64_t rx_ns, map<string, TopicLatency> &latencies, ostream &out)
+{
+    TCP_Header h;
+    memcpy(&h, frame, sizeof(h));
+    const uint8_t *content = frame + sizeof(TCP_Header);
+    // If the packet is traced, record its latencies and skip the extension
+    if (h.data_type & TRACE_FLAG)
+    {
+        TraceExtension ext;
+        memcpy(&ext, content, sizeof(ext));
+        TopicLatency &topic_latency = latencies[string(h.topic, strnlen(h.topic, MAX_TOPIC_SIZE))];
+        RecordLatency(topic_latency.broker, ext.tx_ns - ext.rx_ns);
+        RecordLatency(topic_latency.delivery, rx_ns - ext.tx_ns);
+        // Strip the extension so the rest of the packet parses as usual
+        content += sizeof(ext);
+        h.data_type &= ~TRACE_FLAG;
+        h.length -= sizeof(ext);
+    }
+    // Check that the content fits a string
+    if (h.length < (int)sizeof(TCP_Header) || h.length - (int)sizeof(TCP_Header) > MAX_STRING_SIZE)
+    {
+        cerr << "Invalid packet length" << endl;
+        return;
+    }
+    // Print udp IP, port, topic
+    struct in_addr ip_addr;
+    ip_addr.s_addr = h.ip;
+    out << inet_ntoa(ip_addr) << ":" << h.port << " - " << h.topic << " - ";
+    // Parse data based on data type and print it
+    ParseContent(content, h, out);
+}
+
+// TCP flow, frame is a preallocated buffer of MAX_PACKET_SIZE bytes
+int TCPFLow(ServerStream &stream, uint8_t *frame, map<string, TopicLatency> &latencies)
+{
+    // A compressed block holds several frames, print all of them
+    do
+    {
+        uint64_t rx_ns = 0;
+        int res = ReceiveFrame(stream, frame, rx_ns);
+        if (res == 1)
+        {
+            return 1;
+        }
+        if (res == 0)
+        {
+            PrintFrame(frame, rx_ns, latencies, cout);
+        }
+    } while (HasBufferedFrames(stream));
+    return 0;
+}
+
+// One raw frame in the queue between the network and the render thread
+struct FrameSlot
+{
+    uint64_t rx_ns;
+    uint8_t frame[MAX_PACKET_SIZE];
+};
+
+// Lock-free single producer, single consumer ring of frames
+// The network thread only moves tail, the render thread only moves head
+struct FrameQueue
+{
+    FrameSlot *slots;
+    size_t capacity; // Power of two
+    alignas(64) atomic<size_t> head;
+    alignas(64) atomic<size_t> tail;
+    atomic<bool> closed;
+    // Producer side statistics
+    size_t max_depth;
+    uint64_t full_waits;
+};
+
+// Function to set up a queue holding at least capacity frames
+int InitFrameQueue(FrameQueue &q, size_t capacity)
+{
+    q.capacity = 1;
+    while (q.capacity < capacity)
+        q.capacity <<= 1;
+    q.slots = (FrameSlot *)AllocBuffer(q.capacity * sizeof(FrameSlot), true);
+    q.head = 0;
+    q.tail = 0;
+    q.closed = false;
+    q.max_depth = 0;
+    q.full_waits = 0;
+    return q.slots ? 0 : -1;
+}
+
+// Function to get the next free slot, waiting while the queue is full
+FrameSlot *ReserveFrame(FrameQueue &q)
+{
+    size_t tail = q.tail.load(memory_order_relaxed);
+    if (tail - q.head.load(memory_order_acquire) == q.capacity)
+    {
+        // Output is slower than the network for longer than the queue can absorb
+        q.full_waits++;
+        while (tail - q.head.load(memory_order_acquire) == q.capacity)
+            this_thread::yield();
+    }
+    return &q.slots[tail & (q.capacity - 1)];
+}
+
+// Function to hand the reserved slot to the render thread
+void PublishFrame(FrameQueue &q)
+{
+    size_t tail = q.tail.load(memory_order_relaxed) + 1;
+    q.tail.store(tail, memory_order_release);
+    size_t depth = tail - q.head.load(memory_order_relaxed);
+    if (depth > q.max_depth)
+        q.max_depth = depth;
+}
+
+// Network side of the TCP flow, queues the frames for the render thread
+int QueuedTCPFlow(ServerStream &stream, FrameQueue &queue)
+{
+    do
+    {
+        FrameSlot *slot = ReserveFrame(queue);
+        int res = ReceiveFrame(stream, slot->frame, slot->rx_ns);
+        if (res == 1)
+        {
+            return 1;
+        }
+        if (res == 0)
+        {
+            PublishFrame(queue);
+        }
+    } while (HasBufferedFrames(stream));
+    return 0;
+}
+
+// Render thread, prints queued frames until the queue is closed and empty
+void RenderFrames(FrameQueue *q, map<string, TopicLatency> *latencies)
+{
+    int idle = 0;
+    while (true)
+    {
+        size_t head = q->head.load(memory_order_relaxed);
+        if (head == q->tail.load(memory_order_acquire))
+        {
+            if (q->closed.load(memory_order_acquire) && head == q->tail.load(memory_order_acquire))
+                break;
+            // Spin a little, then back off so an idle subscriber does not burn a core
+            if (++idle > 1000)
+                this_thread::sleep_for(chrono::microseconds(50));
+            continue;
+        }
+        idle = 0;
+        FrameSlot &slot = q->slots[head & (q->capacity - 1)];
+        // Format the whole line first so it is written at once
+        ostringstream line;
+        PrintFrame(slot.frame, slot.rx_ns, *latencies, line);
+        q->head.store(head + 1, memory_order_release);
+        cout << line.str();
+    }
+}
+
+// Subscriber command line options
+struct SubscriberOptions
+{
+    const char *client_id;
+    const char *server_ip;
+    int port;
+    bool low_latency;
+    int cpu;
+    size_t queue_frames; // 0 runs everything on one thread
+    bool compress;
+    const char *topics_path; // Topics subscribed at startup, NULL for none
+};
+
+// Frames queued between the network and the render thread by default
+const size_t DEFAULT_QUEUE_FRAMES = 4096;
+
+// Function to print usage
+void PrintUsage(const char *name)
+{
+    cerr << "Usage: " << name << " <id> <server_ip> <port> [--low-latency <cpu>] [--threaded[=<frames>]] [--compress]"
+         << " [--topics-file <file>]" << endl;
+}
+
+// Function to parse command line options, returns -1 on invalid arguments
+int ParseSubscriberOptions(int argc, char *argv[], SubscriberOptions &options)
+{
+    static const option long_options[] = {
+        {"low-latency", required_argument, NULL, 'l'},
+        {"threaded", optional_argument, NULL, 'T'},
+        {"compress", no_argument, NULL, 'z'},
+        {"topics-file", required_argument, NULL, 'f'},
+        {NULL, 0, NULL, 0}};
+
+    options.low_latency = false;
+    options.cpu = -1;
+    options.queue_frames = 0;
+    options.compress = false;
+    options.topics_path = NULL;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "l:", long_options, NULL)) != -1)
+    {
+        if (opt == 'l')
+        {
+            options.low_latency = true;
+            options.cpu = atoi(optarg);
+        }
+        else if (opt == 'T' && (!optarg || atoi(optarg) > 0))
+        {
+            options.queue_frames = optarg ? atoi(optarg) : DEFAULT_QUEUE_FRAMES;
+        }
+        else if (opt == 'z')
+        {
+            options.compress = true;
+        }
+        else if (opt == 'f')
+        {
+            options.topics_path = optarg;
+        }
+        else
+        {
+            return -1;
+        }
     }
-    delete[] content;
+    // Exactly three positional arguments, id, server ip and port
+    if (optind != argc - 3)
+    {
+        return -1;
+    }
+    options.client_id = argv[optind];
+    options.server_ip = argv[optind + 1];
+    options.port = atoi(argv[optind + 2]);
     return 0;
 }
 
@@ -212,10 +667,18 @@ int main(int argc, char *argv[])
 {
     // Set stdout to unbuffered
     setvbuf(stdout, NULL, _IONBF, BUFSIZ);
+    // Check if the arguments are correct
+    SubscriberOptions options;
+    if (ParseSubscriberOptions(argc, argv, options) < 0)
+    {
+        PrintUsage(argv[0]);
+        return 1;
+    }
     // Connect to server
-    int server_sock = ConectToServer(argv[2], atoi(argv[3]));
-    // Get client id
-    const char *client_id = argv[1];
+    int server_sock = ConectToServer(options.server_ip, options.port);
+    // Get client id, padded to the fixed size sent to the server
+    char client_id[MAX_ID_SIZE] = {0};
+    strncpy(client_id, options.client_id, MAX_ID_SIZE - 1);
     // Get server ip and port
     int bytes_received = 0;
 
@@ -231,6 +694,73 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    // In low-latency mode spin on a non-blocking socket
+    if (options.low_latency)
+    {
+        SetNonBlocking(server_sock);
+        SetBusyPoll(server_sock, BUSY_POLL_USEC);
+    }
+    // Frame buffer, reused for every packet
+    uint8_t *frame = (uint8_t *)AllocBuffer(MAX_PACKET_SIZE, options.low_latency);
+    if (!frame)
+    {
+        close(server_sock);
+        return 1;
+    }
+
+    // Ask for a compressed stream, the server acknowledges it in band
+    ServerStream stream = {server_sock, false, false, NULL, NULL, 0, 0, 0, 0};
+    if (options.compress)
+    {
+        SubscribeMessage compress_msg;
+        memset(&compress_msg, 0, sizeof(compress_msg));
+        compress_msg.command = CMD_COMPRESS;
+        stream.packed = (uint8_t *)AllocBuffer(COMPRESS_BLOCK_MAX, options.low_latency);
+        stream.raw = (uint8_t *)AllocBuffer(COMPRESS_BLOCK_MAX, options.low_latency);
+        if (!stream.packed || !stream.raw || send_all(server_sock, &compress_msg, sizeof(compress_msg)) < 0)
+        {
+            cerr << "Error requesting compressed stream" << endl;
+            close(server_sock);
+            return 1;
+        }
+        stream.compress_requested = true;
+    }
+
+    // Subscribe to the topics file with bulk commands instead of one message per topic
+    if (options.topics_path)
+    {
+        vector<string> topics;
+        if (ReadTopicsFile(options.topics_path, topics) < 0 ||
+            SendBulkSubscribe(server_sock, CMD_BULK_SUBSCRIBE, topics) < 0)
+        {
+            cerr << "Error subscribing to topics file" << endl;
+            close(server_sock);
+            return 1;
+        }
+        cout << "Subscribed to " << topics.size() << " topics from " << options.topics_path << endl;
+    }
+
+    // Latency histograms of traced messages, per topic
+    map<string, TopicLatency> latencies;
+
+    // In threaded mode this thread only drains the socket, decoding and output run on their own thread
+    FrameQueue queue;
+    thread renderer;
+    if (options.queue_frames > 0)
+    {
+        if (InitFrameQueue(queue, options.queue_frames) < 0)
+        {
+            close(server_sock);
+            return 1;
+        }
+        renderer = thread(RenderFrames, &queue, &latencies);
+    }
+    // Pin the loop to a core only now, a render thread created after it would share that core
+    if (options.low_latency && options.cpu >= 0)
+    {
+        PinToCore(options.cpu);
+    }
+
     // Set up poll for stdin and server socket
     struct pollfd fds[2];
     int nfds = 2;
@@ -245,14 +775,18 @@ int main(int argc, char *argv[])
 
     while (true)
     {
-        // Poll for events
-        int ret = poll(fds, nfds, -1);
+        // Poll for events, or just check for them when spinning in low-latency mode
+        int ret = poll(fds, nfds, options.low_latency ? 0 : -1);
         // If poll fails, break
         if (ret < 0)
         {
             cerr << "Error in poll" << endl;
             break;
         }
+        if (ret == 0)
+        {
+            continue;
+        }
         // If stdin has input
         if ((fds[0].revents & POLLIN) == POLLIN)
         {
@@ -269,7 +803,7 @@ int main(int argc, char *argv[])
         } // If server socket has input, it received packet from server
         else if ((fds[1].revents & POLLIN) == POLLIN)
         {
-            int res = TCPFLow(server_sock);
+            int res = options.queue_frames > 0 ? QueuedTCPFlow(stream, queue) : TCPFLow(stream, frame, latencies);
             // If server socket received packet with no data, break
             if (res == 1)
             {
@@ -277,7 +811,31 @@ int main(int argc, char *argv[])
             }
         }
     }
+    // Let the render thread print what is left, then report how deep the queue got
+    if (options.queue_frames > 0)
+    {
+        queue.closed.store(true, memory_order_release);
+        renderer.join();
+        cerr << "Frame queue: max depth " << queue.max_depth << " of " << queue.capacity << " frames, full "
+             << queue.full_waits << " times" << endl;
+        FreeBuffer(queue.slots, queue.capacity * sizeof(FrameSlot), true);
+    }
+    // Report latencies if the server traced any message
+    PrintLatencyReport(latencies);
+    // Report how much the compressed stream saved
+    if (options.compress)
+    {
+        if (stream.raw_bytes > 0)
+        {
+            cerr << "Compressed stream: " << stream.wire_bytes << " bytes received for " << stream.raw_bytes
+                 << " bytes of frames (" << fixed << setprecision(1) << 100.0 * stream.wire_bytes / stream.raw_bytes
+                 << "%)" << endl;
+        }
+        FreeBuffer(stream.packed, COMPRESS_BLOCK_MAX, options.low_latency);
+        FreeBuffer(stream.raw, COMPRESS_BLOCK_MAX, options.low_latency);
+    }
     // Close server socket
     close(server_sock);
+    FreeBuffer(frame, MAX_PACKET_SIZE, options.low_latency);
     return 0;
 }
@@ -5,6 +5,7 @@ import time
 import os
 import pprint
 import json
+import socket
 
 from contextlib import contextmanager
 from subprocess import Popen, PIPE, STDOUT
@@ -43,6 +44,7 @@ tests = {
   "c2_subscribe_star_wildcard": "not executed",
   "c2_subscribe_compound_wildcard": "not executed",
   "c2_subscribe_wildcard_set_inclusion": "not executed",
+  "c2_short_datagram": "not executed",
   "server_stop": "not executed",
 }
 
@@ -826,6 +828,40 @@ def run_test_c2_subscribe_wildcard_set_inclusion(c2, topics):
   if success:
     pass_test("c2_subscribe_wildcard_set_inclusion")
 
+def run_test_c2_short_datagram(server, c2, topics):
+  """Tests that a datagram too short to hold a topic does not reach subscribers."""
+  # setup the test
+  fail_test("c2_short_datagram")
+
+  # subscribe to topics
+  wildcard = '*'
+  print("Subscribing C2 to topics " + wildcard)
+  if subscribe_to_topic(c2, "", wildcard) == -1:
+    return
+
+  # send a datagram shorter than a topic
+  print("Sending a 1 byte datagram")
+  udp = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+  udp.sendto(b"x", (ip, int(port)))
+  udp.close()
+
+  # run the checks, C2 must stay connected and still receive messages
+  success = True
+  outs = server.get_output_timeout(1)
+  if outs != "timeout":
+    print("Error: server printing [" + outs.rstrip() + "]")
+    success = False
+
+  run_udp_client(False, ["0"], "sample_wildcard_payloads.json")
+  success = check_subscriber_output(c2, "2", topics[0].print()) and success
+
+  # unsubscribe from topics
+  c2.send_input("unsubscribe " + wildcard)
+  c2.get_output_timeout(1)
+
+  if success:
+    pass_test("c2_short_datagram")
+
 def h2_test():
   """Runs all the tests."""
 
@@ -888,6 +924,9 @@ def h2_test():
           # subscribe C2 to topics containing wildcards and check for duplicate messages
           run_test_c2_subscribe_wildcard_set_inclusion(c2, wildcard_topics)
 
+          # send a datagram too short to hold a topic and check that C2 is not affected
+          run_test_c2_short_datagram(server, c2, wildcard_topics)
+
           # stop C2 and check it exits correctly
           success = run_test_c2_stop(server, c2)
 
@@ -0,0 +1,203 @@
+#include "helper.h"
+#include <random>
+#include <chrono>
+
+using namespace std;
+
+// Benchmark settings
+struct BenchOptions
+{
+    int clients;
+    int subscriptions;
+    int depth;
+    double seconds;
+    unsigned seed;
+};
+
+// Level names of the generated topic tree, one level of the tree per entry
+// Short enough that a topic of every level, e.g. site1/bldg2/flr3/room4/dev5/sens0/met1/unit2,
+// fits the MAX_TOPIC_SIZE - 1 characters the server accepts
+const char *LEVEL_NAMES[] = {"site", "bldg", "flr", "room", "dev", "sens", "met", "unit"};
+const int LEVEL_COUNT = sizeof(LEVEL_NAMES) / sizeof(LEVEL_NAMES[0]);
+// Distinct values of each level
+const int LEVEL_WIDTH = 6;
+// Number of distinct published topics
+const int PUBLISHED_TOPICS = 1024;
+
+// Function to build a random topic with a depth between 3 and max_depth levels
+vector<string> RandomLevels(mt19937 &rng, int max_depth)
+{
+    int depth = 3 + rng() % (max_depth - 2);
+    vector<string> levels;
+    for (int i = 0; i < depth; i++)
+    {
+        levels.push_back(string(LEVEL_NAMES[i]) + to_string(rng() % LEVEL_WIDTH));
+    }
+    return levels;
+}
+
+// Function to join levels into a topic
+string JoinLevels(const vector<string> &levels)
+{
+    string topic;
+    for (size_t i = 0; i < levels.size(); i++)
+    {
+        if (i > 0)
+            topic += '/';
+        topic += levels[i];
+    }
+    return topic;
+}
+
+// Function to build a subscription pattern with a realistic wildcard mix
+string RandomPattern(mt19937 &rng, int max_depth)
+{
+    vector<string> levels = RandomLevels(rng, max_depth);
+    int kind = rng() % 20;
+    if (kind < 8)
+    {
+        // Exact topic
+    }
+    else if (kind < 14)
+    {
+        // One level wildcard
+        levels[rng() % levels.size()] = "+";
+    }
+    else if (kind < 17)
+    {
+        // Two level wildcards
+        levels[rng() % levels.size()] = "+";
+        levels[rng() % levels.size()] = "+";
+    }
+    else if (kind < 19)
+    {
+        // Everything under a prefix
+        levels.resize(1 + rng() % (levels.size() - 1));
+        levels.push_back("*");
+    }
+    else
+    {
+        // Wildcard in the middle, e.g. site1/*/metric2
+        size_t keep = 1 + rng() % (levels.size() - 1);
+        string last = levels.back();
+        levels.resize(keep);
+        levels.push_back("*");
+        levels.push_back(last);
+    }
+    return JoinLevels(levels);
+}
+
+// Function to route one topic through all clients, same loop as FindTopic
+int CountDeliveries(bool (*matcher)(const string &, const string &), const vector<set<string>> &clients,
+                    const string &topic, long &checks)
+{
+    int deliveries = 0;
+    for (const auto &topics : clients)
+    {
+        for (const auto &t : topics)
+        {
+            checks++;
+            if (matcher(t, topic))
+            {
+                deliveries++;
+                break;
+            }
+        }
+    }
+    return deliveries;
+}
+
+// Function to run one matcher for the configured time and print its throughput
+void RunMatcher(const char *name, bool (*matcher)(const string &, const string &),
+                const vector<set<string>> &clients, const vector<string> &published, double seconds)
+{
+    long messages = 0;
+    long checks = 0;
+    long deliveries = 0;
+    auto start = chrono::steady_clock::now();
+    double elapsed = 0;
+    while (elapsed < seconds)
+    {
+        deliveries += CountDeliveries(matcher, clients, published[messages % published.size()], checks);
+        messages++;
+        elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+    cout << left << setw(8) << name << right << fixed << setprecision(1)
+         << setw(12) << messages / elapsed << " msg/s"
+         << setw(14) << checks / elapsed / 1e6 << " M checks/s"
+         << setw(10) << elapsed * 1e9 / checks << " ns/check"
+         << setw(10) << (double)deliveries / messages << " deliveries/msg" << endl;
+}
+
+// Function to print usage
+void PrintUsage(const char *name)
+{
+    cerr << "Usage: " << name << " [-c clients] [-s subscriptions per client] [-d max depth] [-t seconds] [-r seed]" << endl;
+}
+
+int main(int argc, char *argv[])
+{
+    BenchOptions options = {1000, 20, 7, 2.0, 1};
+    int opt;
+    while ((opt = getopt(argc, argv, "c:s:d:t:r:")) != -1)
+    {
+        if (opt == 'c')
+            options.clients = atoi(optarg);
+        else if (opt == 's')
+            options.subscriptions = atoi(optarg);
+        else if (opt == 'd')
+            options.depth = atoi(optarg);
+        else if (opt == 't')
+            options.seconds = atof(optarg);
+        else if (opt == 'r')
+            options.seed = strtoul(optarg, NULL, 10);
+        else
+        {
+            PrintUsage(argv[0]);
+            return 1;
+        }
+    }
+    if (options.clients < 1 || options.subscriptions < 1 || options.depth < 3 || options.depth > LEVEL_COUNT)
+    {
+        PrintUsage(argv[0]);
+        return 1;
+    }
+
+    // Build the subscription sets and the published topics
+    mt19937 rng(options.seed);
+    vector<set<string>> clients(options.clients);
+    for (auto &topics : clients)
+    {
+        while ((int)topics.size() < options.subscriptions)
+            topics.insert(RandomPattern(rng, options.depth));
+    }
+    vector<string> published;
+    for (int i = 0; i < PUBLISHED_TOPICS; i++)
+    {
+        published.push_back(JoinLevels(RandomLevels(rng, options.depth)));
+        // The broker never delivers longer topics, they must not be measured
+        if (published.back().size() > MAX_TOPIC_SIZE - 1)
+        {
+            cerr << "Generated topic " << published.back() << " is too long" << endl;
+            return 1;
+        }
+    }
+
+    // Both matchers must route a sample of the published topics the same way
+    for (size_t i = 0; i < published.size(); i += published.size() / 4)
+    {
+        long checks = 0;
+        if (CountDeliveries(TopicMatches, clients, published[i], checks) !=
+            CountDeliveries(TopicMatchesFast, clients, published[i], checks))
+        {
+            cerr << "Matchers disagree on topic " << published[i] << endl;
+            return 1;
+        }
+    }
+
+    cout << options.clients << " clients, " << options.subscriptions << " subscriptions each, depth up to "
+         << options.depth << ", seed " << options.seed << endl;
+    RunMatcher("regex", TopicMatches, clients, published, options.seconds);
+    RunMatcher("fast", TopicMatchesFast, clients, published, options.seconds);
+    return 0;
+}
@@ -0,0 +1,122 @@
+#include "helper.h"
+#include <random>
+
+using namespace std;
+
+// Characters used to build topics and patterns. Other characters are regex
+// metacharacters for TopicMatches ('.', '?', '(', ...) and are not part of the
+// supported topic syntax, so they are left out on purpose.
+const char TOPIC_CHARS[] = "ab_1";
+
+// Hand picked cases around level boundaries and empty levels
+const char *EDGE_CASES[][2] = {
+    {"", ""}, {"*", ""}, {"+", ""}, {"*", "/"}, {"+", "/"}, {"a/+", "a/"},
+    {"a/+", "a/b"}, {"a/+", "a/b/c"}, {"a/*", "a/"}, {"a/*", "a"}, {"a/*/b", "a/b"},
+    {"a/*/b", "a//b"}, {"a/*/b", "a/x/y/b"}, {"+/+", "a/b"}, {"+/+", "/b"},
+    {"+b", "ab"}, {"+b", "b"}, {"a+", "a/"}, {"**", "a/b"}, {"*+", "a/"},
+    {"+*", "a"}, {"++", "a"}, {"++", "ab"}, {"a*b+", "ab/b"}, {"*/+/*", "//a//"},
+};
+
+// Function to build a random string from TOPIC_CHARS and '/'
+string RandomTopic(mt19937 &rng, int max_len)
+{
+    int len = rng() % (max_len + 1);
+    string topic;
+    for (int i = 0; i < len; i++)
+    {
+        // Levels separators are frequent so that '+' and '*' have levels to work on
+        if (rng() % 4 == 0)
+            topic += '/';
+        else
+            topic += TOPIC_CHARS[rng() % (sizeof(TOPIC_CHARS) - 1)];
+    }
+    return topic;
+}
+
+// Function to build a pattern, either random or derived from the topic so it
+// has a good chance of matching
+string RandomPattern(mt19937 &rng, const string &topic, int max_len)
+{
+    if (rng() % 2 == 0)
+    {
+        string pattern = RandomTopic(rng, max_len);
+        for (auto &c : pattern)
+        {
+            if (rng() % 5 == 0)
+                c = (rng() % 2) ? '+' : '*';
+        }
+        return pattern;
+    }
+    // Replace random spans of the topic with wildcards
+    string pattern;
+    size_t i = 0;
+    while (i < topic.size())
+    {
+        int choice = rng() % 6;
+        size_t span = 1 + rng() % 4;
+        if (choice == 0)
+        {
+            pattern += '+';
+            i += span;
+        }
+        else if (choice == 1)
+        {
+            pattern += '*';
+            i += span;
+        }
+        else
+        {
+            pattern += topic[i];
+            i++;
+        }
+    }
+    if (rng() % 8 == 0)
+        pattern += '*';
+    return pattern;
+}
+
+// Function to compare both matchers on one input, returns false on mismatch
+bool Check(const string &pattern, const string &topic)
+{
+    bool expected = TopicMatches(pattern, topic);
+    bool actual = TopicMatchesFast(pattern, topic);
+    if (expected != actual)
+    {
+        cerr << "Mismatch: pattern \"" << pattern << "\" topic \"" << topic << "\" regex " << expected
+             << " fast " << actual << endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    // Usage: topic_fuzz [iterations] [seed]
+    long iterations = argc > 1 ? atol(argv[1]) : 200000;
+    unsigned seed = argc > 2 ? strtoul(argv[2], NULL, 10) : random_device()();
+    mt19937 rng(seed);
+    cout << "Fuzzing TopicMatchesFast against TopicMatches, " << iterations << " iterations, seed " << seed << endl;
+
+    for (const auto &edge : EDGE_CASES)
+    {
+        if (!Check(edge[0], edge[1]))
+            return 1;
+    }
+
+    long matches = 0;
+    for (long i = 0; i < iterations; i++)
+    {
+        // Mostly short inputs, sometimes up to the maximum topic size
+        int max_len = (rng() % 16 == 0) ? MAX_TOPIC_SIZE - 1 : 12;
+        string topic = RandomTopic(rng, max_len);
+        string pattern = RandomPattern(rng, topic, max_len);
+        if (!Check(pattern, topic))
+        {
+            cerr << "Reproduce with: ./topic_fuzz " << iterations << " " << seed << endl;
+            return 1;
+        }
+        matches += TopicMatches(pattern, topic);
+    }
+    cout << "OK, " << matches << " of " << iterations << " inputs matched" << endl;
+    return 0;
+}